@@ -0,0 +1,141 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "arm64_insn.h"
+
+extern "C" {
+#include "insn.h"
+}
+
+static int64_t sign_extend(uint64_t value, unsigned bits)
+{
+    auto shift = 64 - bits;
+    return static_cast<int64_t>(value << shift) >> shift;
+}
+
+static uint8_t reg_of(enum aarch64_insn_register_type type, uint32_t word)
+{
+    return aarch64_insn_decode_register(type, word);
+}
+
+static bool decode_load_store(uint32_t word, Arm64Insn& insn)
+{
+    // ldr/str w and x as [rn, #imm] and [rn, #imm]!, not the byte, half word and signed forms
+    auto size = word >> 30;
+    if (size < 2) {
+        return false;
+    }
+
+    if (aarch64_insn_is_load_imm(word) or aarch64_insn_is_store_imm(word)) {
+        insn.op = aarch64_insn_is_load_imm(word) ? Arm64Op::Ldr : Arm64Op::Str;
+        insn.imm = aarch64_insn_decode_immediate(AARCH64_INSN_IMM_12, word) << size;
+    } else if (aarch64_insn_is_load_pre(word) or aarch64_insn_is_store_pre(word)) {
+        insn.op = aarch64_insn_is_load_pre(word) ? Arm64Op::Ldr : Arm64Op::Str;
+        insn.imm = sign_extend(aarch64_insn_decode_immediate(AARCH64_INSN_IMM_9, word), 9);
+    } else {
+        return false;
+    }
+
+    insn.rd = reg_of(AARCH64_INSN_REGTYPE_RT, word);
+    insn.rn = reg_of(AARCH64_INSN_REGTYPE_RN, word);
+    insn.wide = size == 3;
+    return true;
+}
+
+Arm64Insn arm64_decode(uint32_t word, uint64_t pc)
+{
+    Arm64Insn insn {};
+
+    switch (aarch64_get_insn_class(word)) {
+    case AARCH64_INSN_CLS_LDST:
+        if (aarch64_insn_is_ldr_lit(word)) {
+            insn.op = Arm64Op::LdrLiteral;
+            insn.rd = reg_of(AARCH64_INSN_REGTYPE_RT, word);
+            insn.wide = (word >> 30) & 1;
+            insn.imm = pc + sign_extend(aarch64_insn_decode_immediate(AARCH64_INSN_IMM_19, word), 19) * 4;
+        } else {
+            decode_load_store(word, insn);
+        }
+        break;
+
+    case AARCH64_INSN_CLS_BR_SYS:
+        if (aarch64_insn_is_cbz(word) or aarch64_insn_is_cbnz(word)) {
+            insn.op = aarch64_insn_is_cbz(word) ? Arm64Op::Cbz : Arm64Op::Cbnz;
+            insn.rd = reg_of(AARCH64_INSN_REGTYPE_RT, word);
+            insn.wide = word >> 31;
+            insn.imm = pc + sign_extend(aarch64_insn_decode_immediate(AARCH64_INSN_IMM_19, word), 19) * 4;
+        } else if (aarch64_insn_is_ret(word)) {
+            insn.op = Arm64Op::Ret;
+            insn.rn = reg_of(AARCH64_INSN_REGTYPE_RN, word);
+        }
+        break;
+
+    case AARCH64_INSN_CLS_DP_IMM:
+        insn.rd = reg_of(AARCH64_INSN_REGTYPE_RD, word);
+        insn.wide = word >> 31;
+
+        if (aarch64_insn_is_adr(word) or aarch64_insn_is_adrp(word)) {
+            auto offset = sign_extend(aarch64_insn_decode_immediate(AARCH64_INSN_IMM_ADR, word), 21);
+            if (aarch64_insn_is_adr(word)) {
+                insn.op = Arm64Op::Adr;
+                insn.imm = pc + offset;
+            } else {
+                insn.op = Arm64Op::Adrp;
+                insn.imm = (pc & ~UINT64_C(0xfff)) + offset * 4096;
+            }
+            insn.wide = true;
+        } else if (aarch64_insn_is_movz(word) or aarch64_insn_is_movn(word) or aarch64_insn_is_movk(word)) {
+            insn.op = aarch64_insn_is_movz(word) ? Arm64Op::Movz
+                : aarch64_insn_is_movn(word)     ? Arm64Op::Movn
+                                                 : Arm64Op::Movk;
+            insn.shift = ((word >> 21) & 3) * 16;
+            insn.imm = static_cast<int64_t>(aarch64_insn_decode_immediate(AARCH64_INSN_IMM_16, word)) << insn.shift;
+        } else if (aarch64_insn_is_add_imm(word) or aarch64_insn_is_subs_imm(word)) {
+            insn.rn = reg_of(AARCH64_INSN_REGTYPE_RN, word);
+            insn.shift = (word & (1 << 22)) ? 12 : 0;
+            insn.imm = aarch64_insn_decode_immediate(AARCH64_INSN_IMM_12, word) << insn.shift;
+            if (aarch64_insn_is_add_imm(word)) {
+                insn.op = Arm64Op::AddImm;
+            } else if (insn.rd == 31) {
+                // cmp is subs into xzr
+                insn.op = Arm64Op::CmpImm;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return insn;
+}
+
+uint64_t arm64_mov_wide(const Arm64Insn& insn, uint64_t value)
+{
+    auto imm = static_cast<uint64_t>(insn.imm);
+    auto mask = insn.wide ? ~UINT64_C(0) : UINT64_C(0xffffffff);
+
+    switch (insn.op) {
+    case Arm64Op::Movz:
+        return imm;
+    case Arm64Op::Movn:
+        return ~imm & mask;
+    case Arm64Op::Movk:
+        return (value & ~(UINT64_C(0xffff) << insn.shift)) | imm;
+    default:
+        return value;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __arm64_insn_h__
+#define __arm64_insn_h__
+
+#include <cstdint>
+
+/*
+    The AArch64 forms the kdeploy probes match, decoded straight from the
+    instruction word with the kernel's helpers in libs/insn. Anything else
+    is Other, no operands are decoded for it.
+*/
+enum class Arm64Op : uint8_t {
+    Other,
+    Ldr, // [rn, #imm] and [rn, #imm]!
+    LdrLiteral,
+    Str,
+    Cbz,
+    Cbnz,
+    Movz,
+    Movn,
+    Movk,
+    Adr,
+    Adrp,
+    AddImm,
+    CmpImm,
+    Ret,
+};
+
+// register 31 is sp or xzr depending on the form
+struct Arm64Insn {
+    Arm64Op op { Arm64Op::Other };
+    uint8_t rd { 0 }; // Rd, Rt for loads, stores and cbz
+    uint8_t rn { 0 };
+    bool wide { false }; // x registers
+    uint8_t shift { 0 }; // of mov wide and add/cmp immediates, already applied to imm
+    int64_t imm { 0 }; // displacement or immediate, the target address of pc relative forms
+};
+
+Arm64Insn arm64_decode(uint32_t word, uint64_t pc);
+
+// register value after a movz/movn/movk, `value` is the value before it
+uint64_t arm64_mov_wide(const Arm64Insn& insn, uint64_t value);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cstring>
+
+#include <boost/log/trivial.hpp>
+
+#include "bootimg.h"
+
+constexpr uint32_t boot_image_v3_page_size = 4096;
+
+static uint64_t page_round(uint64_t size, uint64_t page_size)
+{
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+template <typename H>
+static const H* header_of(std::string_view data)
+{
+    if (data.size() < sizeof(H)) {
+        return nullptr;
+    }
+    return reinterpret_cast<const H*>(data.data());
+}
+
+static bool parse_boot_image_v0(std::string_view data, BootImage& image)
+{
+    auto* hdr = header_of<BootImageHeaderV0>(data);
+    if (hdr == nullptr) {
+        return false;
+    }
+
+    auto page_size = hdr->page_size;
+    if (page_size < 2048 or page_size > 65536 or (page_size & (page_size - 1)) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "invalid boot image page size " << page_size;
+        return false;
+    }
+
+    image.page_size = page_size;
+
+    // header, kernel, ramdisk, second, recovery dtbo, dtb; each page aligned
+    uint64_t offset = page_size;
+
+    image.kernel = { offset, hdr->kernel_size };
+    offset += page_round(hdr->kernel_size, page_size);
+
+    image.ramdisk = { offset, hdr->ramdisk_size };
+    offset += page_round(hdr->ramdisk_size, page_size);
+
+    image.second = { offset, hdr->second_size };
+    offset += page_round(hdr->second_size, page_size);
+
+    if (image.header_version >= 1) {
+        auto* v1 = header_of<BootImageHeaderV1>(data);
+        if (v1 == nullptr) {
+            return false;
+        }
+        image.recovery_dtbo = { v1->recovery_dtbo_offset, v1->recovery_dtbo_size };
+        offset += page_round(v1->recovery_dtbo_size, page_size);
+    }
+
+    if (image.header_version >= 2) {
+        auto* v2 = header_of<BootImageHeaderV2>(data);
+        if (v2 == nullptr) {
+            return false;
+        }
+        image.dtb = { offset, v2->dtb_size };
+    }
+
+    return true;
+}
+
+static bool parse_boot_image_v3(std::string_view data, BootImage& image)
+{
+    auto* hdr = header_of<BootImageHeaderV3>(data);
+    if (hdr == nullptr) {
+        return false;
+    }
+
+    image.page_size = boot_image_v3_page_size;
+
+    // header, kernel, ramdisk, signature; each 4096 aligned
+    uint64_t offset = page_round(hdr->header_size, boot_image_v3_page_size);
+
+    image.kernel = { offset, hdr->kernel_size };
+    offset += page_round(hdr->kernel_size, boot_image_v3_page_size);
+
+    image.ramdisk = { offset, hdr->ramdisk_size };
+    offset += page_round(hdr->ramdisk_size, boot_image_v3_page_size);
+
+    if (image.header_version >= 4) {
+        auto* v4 = header_of<BootImageHeaderV4>(data);
+        if (v4 == nullptr) {
+            return false;
+        }
+        image.signature = { offset, v4->signature_size };
+    }
+
+    return true;
+}
+
+static bool parse_vendor_boot_image(std::string_view data, BootImage& image)
+{
+    auto* hdr = header_of<VendorBootImageHeaderV3>(data);
+    if (hdr == nullptr) {
+        return false;
+    }
+
+    auto page_size = hdr->page_size;
+    if (page_size == 0 or (page_size & (page_size - 1)) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "invalid vendor boot image page size " << page_size;
+        return false;
+    }
+
+    image.vendor = true;
+    image.header_version = hdr->header_version;
+    image.page_size = page_size;
+
+    // header, vendor ramdisk, dtb, vendor ramdisk table, bootconfig; no kernel
+    uint64_t offset = page_round(hdr->header_size, page_size);
+
+    image.ramdisk = { offset, hdr->vendor_ramdisk_size };
+    offset += page_round(hdr->vendor_ramdisk_size, page_size);
+
+    image.dtb = { offset, hdr->dtb_size };
+
+    return true;
+}
+
+bool parse_boot_image(std::string_view data, BootImage& image)
+{
+    image = BootImage {};
+
+    if (data.size() < BOOT_MAGIC_SIZE) {
+        return false;
+    }
+
+    if (memcmp(data.data(), VENDOR_BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
+        return parse_vendor_boot_image(data, image);
+    }
+
+    if (memcmp(data.data(), BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    // header_version sits at the same offset in v0 and v3 headers
+    auto* hdr = header_of<BootImageHeaderV0>(data);
+    if (hdr == nullptr) {
+        return false;
+    }
+
+    image.header_version = hdr->header_version;
+
+    if (image.header_version <= 2) {
+        return parse_boot_image_v0(data, image);
+    }
+
+    if (image.header_version <= 4) {
+        return parse_boot_image_v3(data, image);
+    }
+
+    BOOST_LOG_TRIVIAL(error) << "unsupported boot image header version " << image.header_version;
+    return false;
+}
+
+bool parse_bzimage(std::string_view data, BzImage& image)
+{
+    constexpr size_t setup_sects_offset = 0x1f1;
+    constexpr size_t boot_flag_offset = 0x1fe;
+    constexpr size_t header_offset = 0x202;
+    constexpr size_t version_offset = 0x206;
+    constexpr size_t payload_offset = 0x248;
+    constexpr size_t payload_length_offset = 0x24c;
+
+    image = BzImage {};
+
+    if (data.size() < payload_length_offset + sizeof(uint32_t)) {
+        return false;
+    }
+
+    auto read = [&](size_t offset, auto& value) {
+        memcpy(&value, data.data() + offset, sizeof(value));
+    };
+
+    uint16_t boot_flag { 0 };
+    read(boot_flag_offset, boot_flag);
+    if (boot_flag != 0xaa55 or memcmp(data.data() + header_offset, "HdrS", 4) != 0) {
+        return false;
+    }
+
+    read(version_offset, image.version);
+    if (image.version < 0x208) {
+        BOOST_LOG_TRIVIAL(error) << "bzImage boot protocol " << (image.version >> 8) << "." << (image.version & 0xff) << " has no payload information";
+        return false;
+    }
+
+    // the protected mode kernel follows the boot sector and the setup sectors, 0 means 4
+    uint8_t setup_sects { 0 };
+    read(setup_sects_offset, setup_sects);
+    uint64_t protected_mode = (setup_sects == 0 ? 4 + 1 : setup_sects + 1) * 512ull;
+
+    uint32_t offset { 0 };
+    uint32_t length { 0 };
+    read(payload_offset, offset);
+    read(payload_length_offset, length);
+
+    image.payload = { protected_mode + offset, length };
+    return true;
+}
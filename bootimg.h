@@ -0,0 +1,137 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __bootimg_h__
+#define __bootimg_h__
+
+#include <cstdint>
+#include <string_view>
+
+// android system/tools/mkbootimg/include/bootimg/bootimg.h
+
+#define BOOT_MAGIC "ANDROID!"
+#define VENDOR_BOOT_MAGIC "VNDRBOOT"
+#define BOOT_MAGIC_SIZE 8
+
+struct BootImageHeaderV0 {
+    char magic[BOOT_MAGIC_SIZE];
+
+    uint32_t kernel_size;
+    uint32_t kernel_addr;
+
+    uint32_t ramdisk_size;
+    uint32_t ramdisk_addr;
+
+    uint32_t second_size;
+    uint32_t second_addr;
+
+    uint32_t tags_addr;
+    uint32_t page_size;
+
+    uint32_t header_version;
+    uint32_t os_version;
+
+    char name[16];
+    char cmdline[512];
+    uint32_t id[8];
+    char extra_cmdline[1024];
+} __attribute__((packed));
+
+struct BootImageHeaderV1 : BootImageHeaderV0 {
+    uint32_t recovery_dtbo_size;
+    uint64_t recovery_dtbo_offset;
+    uint32_t header_size;
+} __attribute__((packed));
+
+struct BootImageHeaderV2 : BootImageHeaderV1 {
+    uint32_t dtb_size;
+    uint64_t dtb_addr;
+} __attribute__((packed));
+
+// v3 and later, the page size is fixed to 4096
+struct BootImageHeaderV3 {
+    char magic[BOOT_MAGIC_SIZE];
+
+    uint32_t kernel_size;
+    uint32_t ramdisk_size;
+    uint32_t os_version;
+    uint32_t header_size;
+    uint32_t reserved[4];
+
+    uint32_t header_version;
+
+    char cmdline[1536];
+} __attribute__((packed));
+
+struct BootImageHeaderV4 : BootImageHeaderV3 {
+    uint32_t signature_size;
+} __attribute__((packed));
+
+struct VendorBootImageHeaderV3 {
+    char magic[BOOT_MAGIC_SIZE];
+    uint32_t header_version;
+    uint32_t page_size;
+    uint32_t kernel_addr;
+    uint32_t ramdisk_addr;
+    uint32_t vendor_ramdisk_size;
+    char cmdline[2048];
+    uint32_t tags_addr;
+    char name[16];
+    uint32_t header_size;
+    uint32_t dtb_size;
+    uint64_t dtb_addr;
+} __attribute__((packed));
+
+struct VendorBootImageHeaderV4 : VendorBootImageHeaderV3 {
+    uint32_t vendor_ramdisk_table_size;
+    uint32_t vendor_ramdisk_table_entry_num;
+    uint32_t vendor_ramdisk_table_entry_size;
+    uint32_t bootconfig_size;
+} __attribute__((packed));
+
+struct BootImageSection {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct BootImage {
+    bool vendor { false };
+    uint32_t header_version { 0 };
+    uint32_t page_size { 0 };
+
+    BootImageSection kernel {};
+    BootImageSection ramdisk {};
+    BootImageSection second {};
+    BootImageSection recovery_dtbo {};
+    BootImageSection dtb {};
+    BootImageSection signature {};
+};
+
+// parse the boot/vendor_boot header at the start of `data`
+bool parse_boot_image(std::string_view data, BootImage& image);
+
+// x86 boot protocol, Documentation/arch/x86/boot.rst
+struct BzImage {
+    uint16_t version { 0 };
+
+    // the compressed vmlinux, offset from the start of the file
+    BootImageSection payload {};
+};
+
+// parse the setup header at the start of `data`, boot protocol 2.08 and later
+bool parse_bzimage(std::string_view data, BzImage& image);
+
+#endif
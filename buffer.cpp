@@ -0,0 +1,171 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "buffer.h"
+
+static size_t page_align(size_t size)
+{
+    static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+ImageBuffer::ImageBuffer(ImageBuffer&& other) noexcept
+    : _data(other._data)
+    , _size(other._size)
+    , _capacity(other._capacity)
+    , _file_backed(other._file_backed)
+{
+    other._data = nullptr;
+    other._size = 0;
+    other._capacity = 0;
+    other._file_backed = false;
+}
+
+ImageBuffer& ImageBuffer::operator=(ImageBuffer&& other) noexcept
+{
+    if (this != &other) {
+        clear();
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+        std::swap(_capacity, other._capacity);
+        std::swap(_file_backed, other._file_backed);
+    }
+    return *this;
+}
+
+ImageBuffer::~ImageBuffer()
+{
+    clear();
+}
+
+ImageBuffer ImageBuffer::map(int fd, size_t size, off_t offset)
+{
+    ImageBuffer buffer {};
+
+    if (size == 0) {
+        return buffer;
+    }
+
+    auto capacity = page_align(size);
+
+    // writable, but private: relocation only copies the pages it touches
+    void* addr = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error { std::string { "failed to map kernel image: " } + strerror(errno) };
+    }
+
+    buffer._data = static_cast<char*>(addr);
+    buffer._size = size;
+    buffer._capacity = capacity;
+    buffer._file_backed = true;
+    return buffer;
+}
+
+void ImageBuffer::reserve(size_t capacity)
+{
+    if (capacity <= _capacity) {
+        return;
+    }
+
+    if (_file_backed) {
+        throw std::logic_error { "file backed image buffer can not grow" };
+    }
+
+    capacity = page_align(capacity);
+
+    void* addr { nullptr };
+    if (_data == nullptr) {
+        addr = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        addr = ::mremap(_data, _capacity, capacity, MREMAP_MAYMOVE);
+    }
+
+    if (addr == MAP_FAILED) {
+        throw std::bad_alloc {};
+    }
+
+    _data = static_cast<char*>(addr);
+    _capacity = capacity;
+}
+
+void ImageBuffer::resize(size_t size)
+{
+    if (size > _capacity) {
+        reserve(size);
+    }
+    _size = size;
+}
+
+void ImageBuffer::shrink_to_fit()
+{
+    if (_file_backed or _data == nullptr) {
+        return;
+    }
+
+    if (_size == 0) {
+        clear();
+        return;
+    }
+
+    auto capacity = page_align(_size);
+    if (capacity < _capacity) {
+        void* addr = ::mremap(_data, _capacity, capacity, 0);
+        if (addr != MAP_FAILED) {
+            _capacity = capacity;
+        }
+    }
+}
+
+void ImageBuffer::drop_front(size_t size)
+{
+    if (size != page_align(size)) {
+        throw std::invalid_argument { "unaligned image buffer front" };
+    }
+
+    if (size >= _capacity) {
+        clear();
+        return;
+    }
+
+    if (size == 0) {
+        return;
+    }
+
+    ::munmap(_data, size);
+    _data += size;
+    _size = size < _size ? _size - size : 0;
+    _capacity -= size;
+}
+
+void ImageBuffer::clear()
+{
+    if (_data != nullptr) {
+        ::munmap(_data, _capacity);
+    }
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+    _file_backed = false;
+}
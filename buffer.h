@@ -0,0 +1,75 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __buffer_h__
+#define __buffer_h__
+
+#include <sys/types.h>
+
+#include <cstddef>
+
+/*
+    Page aligned kernel image buffer.
+
+    The storage is always a mmap:
+      - anonymous, for decompressed images. Pages are zero filled lazily
+        by the kernel, so resize() does not touch memory.
+      - file backed (MAP_PRIVATE), for raw images. Pages stay shared with
+        the page cache until they are written, only modified pages are
+        privately copied.
+*/
+class ImageBuffer {
+    char* _data { nullptr };
+    size_t _size { 0 };
+    size_t _capacity { 0 };
+    bool _file_backed { false };
+
+public:
+    ImageBuffer() = default;
+
+    ImageBuffer(const ImageBuffer&) = delete;
+    ImageBuffer& operator=(const ImageBuffer&) = delete;
+
+    ImageBuffer(ImageBuffer&& other) noexcept;
+    ImageBuffer& operator=(ImageBuffer&& other) noexcept;
+
+    ~ImageBuffer();
+
+    // map `size` bytes of `fd` starting at `offset`, offset must be page aligned
+    static ImageBuffer map(int fd, size_t size, off_t offset = 0);
+
+    void reserve(size_t capacity);
+    void resize(size_t size);
+    void shrink_to_fit();
+    void clear();
+
+    // release the first `size` bytes without copying, `size` must be a multiple of the page size
+    void drop_front(size_t size);
+
+    char* data() { return _data; }
+    const char* data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+    // length of the mapping, multiple of the page size
+    size_t capacity() const { return _capacity; }
+
+    bool empty() const { return _size == 0; }
+
+    bool file_backed() const { return _file_backed; }
+};
+
+#endif
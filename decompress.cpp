@@ -0,0 +1,524 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <endian.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/log/trivial.hpp>
+
+#include "zlib.h"
+
+#ifdef KDEPLOY_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef KDEPLOY_WITH_LZMA
+#include <lzma.h>
+#endif
+
+#include "decompress.h"
+
+constexpr size_t input_chunk_size = 1024 * 1024;
+constexpr size_t initial_output_size = 16 * 1024 * 1024;
+constexpr size_t min_output_room = 64 * 1024;
+
+struct PayloadSignature {
+    PayloadFormat format;
+    size_t offset; // of the magic, relative to the start of the payload
+    std::string_view magic;
+};
+
+static const PayloadSignature payload_signatures[] = {
+    { PayloadFormat::Gzip, 0, { "\x1F\x8B\x08", 3 } },
+    { PayloadFormat::Lz4Legacy, 0, { "\x02\x21\x4C\x18", 4 } },
+    { PayloadFormat::Zstd, 0, { "\x28\xB5\x2F\xFD", 4 } },
+    { PayloadFormat::Xz, 0, { "\xFD" "7zXZ\0", 6 } },
+    // arm64 Image header
+    { PayloadFormat::Raw, 0x38, { "ARM\x64", 4 } },
+};
+
+const char* payload_format_name(PayloadFormat format)
+{
+    switch (format) {
+    case PayloadFormat::Raw:
+        return "raw";
+    case PayloadFormat::Gzip:
+        return "gzip";
+    case PayloadFormat::Lz4Legacy:
+        return "lz4-legacy";
+    case PayloadFormat::Zstd:
+        return "zstd";
+    case PayloadFormat::Xz:
+        return "xz";
+    default:
+        return "unknown";
+    }
+}
+
+PayloadFormat detect_payload(std::string_view data)
+{
+    for (auto& sig : payload_signatures) {
+        if (data.size() >= sig.offset + sig.magic.size()
+            and data.substr(sig.offset, sig.magic.size()) == sig.magic) {
+            return sig.format;
+        }
+    }
+    return PayloadFormat::Unknown;
+}
+
+ssize_t find_payload(std::string_view data, PayloadFormat* format)
+{
+    for (size_t pos = 0; pos < data.size(); ++pos) {
+        auto fmt = detect_payload(data.substr(pos));
+        if (fmt != PayloadFormat::Unknown) {
+            *format = fmt;
+            return static_cast<ssize_t>(pos);
+        }
+    }
+    return -1;
+}
+
+PayloadStream::PayloadStream(UniqueFD fd, off_t offset, size_t size)
+    : _fd(std::move(fd))
+    , _offset(offset)
+    , _end(size == 0 ? 0 : offset + static_cast<off_t>(size))
+{
+}
+
+size_t PayloadStream::read_input(void* buffer, size_t size)
+{
+    if (_end != 0) {
+        size = std::min(size, static_cast<size_t>(std::max<off_t>(_end - _offset, 0)));
+    }
+
+    size_t total = 0;
+    while (total < size) {
+        auto sz = ::pread(_fd.get(), static_cast<char*>(buffer) + total, size - total, _offset);
+        if (sz == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error { std::string { "failed to read kernel payload: " } + strerror(errno) };
+        }
+        if (sz == 0) {
+            break;
+        }
+        _offset += sz;
+        total += sz;
+    }
+    return total;
+}
+
+void PayloadStream::grow(ImageBuffer& output, size_t size)
+{
+    if (output.capacity() - output.size() >= size) {
+        return;
+    }
+    output.reserve(std::max({ initial_output_size, output.capacity() * 2, output.size() + size }));
+}
+
+/*
+    raw Image: mapped when the offset allows it, read otherwise
+*/
+class RawStream : public PayloadStream {
+    off_t _start;
+    size_t _size;
+
+public:
+    RawStream(UniqueFD fd, off_t offset, size_t size)
+        : PayloadStream(std::move(fd), offset, size)
+        , _start(offset)
+        , _size(size)
+    {
+        if (_size == 0) {
+            // works for block devices, unlike fstat
+            auto end = ::lseek(input_fd(), 0, SEEK_END);
+            if (end > offset) {
+                _size = end - offset;
+            }
+        }
+    }
+
+    size_t decompress(ImageBuffer& output, size_t limit) override
+    {
+        static const off_t page_size = ::sysconf(_SC_PAGESIZE);
+
+        if (output.empty() and _size != 0 and (_start % page_size) == 0) {
+            output = ImageBuffer::map(input_fd(), _size, _start);
+            _finished = true;
+            close_input();
+            return output.size();
+        }
+
+        while (not _finished and (limit == 0 or output.size() < limit)) {
+            grow(output, input_chunk_size);
+            auto sz = read_input(output.data() + output.size(), input_chunk_size);
+            output.resize(output.size() + sz);
+            if (sz == 0) {
+                _finished = true;
+                close_input();
+            }
+        }
+        return output.size();
+    }
+
+    PayloadFormat format() const override { return PayloadFormat::Raw; }
+};
+
+class GzipStream : public PayloadStream {
+    z_stream _stream {};
+    std::unique_ptr<unsigned char[]> _input;
+
+public:
+    GzipStream(UniqueFD fd, off_t offset, size_t size)
+        : PayloadStream(std::move(fd), offset, size)
+        , _input(new unsigned char[input_chunk_size])
+    {
+        // 16 + MAX_WBITS: gzip wrapper only
+        if (inflateInit2(&_stream, 16 + MAX_WBITS) != Z_OK) {
+            throw std::runtime_error { "failed to initialize zlib" };
+        }
+    }
+
+    ~GzipStream() override
+    {
+        inflateEnd(&_stream);
+    }
+
+    size_t decompress(ImageBuffer& output, size_t limit) override
+    {
+        while (not _finished and (limit == 0 or output.size() < limit)) {
+            if (_stream.avail_in == 0) {
+                auto sz = read_input(_input.get(), input_chunk_size);
+                if (sz == 0) {
+                    throw std::runtime_error { "truncated gzip stream" };
+                }
+                _stream.next_in = _input.get();
+                _stream.avail_in = static_cast<uInt>(sz);
+            }
+
+            grow(output, min_output_room);
+
+            auto size = output.size();
+            auto avail = std::min<size_t>(output.capacity() - size, UINT32_MAX);
+
+            _stream.next_out = reinterpret_cast<Bytef*>(output.data() + size);
+            _stream.avail_out = static_cast<uInt>(avail);
+
+            auto ret = inflate(&_stream, Z_NO_FLUSH);
+
+            output.resize(size + (avail - _stream.avail_out));
+
+            if (ret == Z_STREAM_END) {
+                // anything behind the stream (ramdisk, signature) is not ours
+                _finished = true;
+                close_input();
+            } else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+                throw std::runtime_error { std::string { "failed to decompress zImage: " } + (_stream.msg ? _stream.msg : std::to_string(ret)) };
+            }
+        }
+
+        return output.size();
+    }
+
+    PayloadFormat format() const override { return PayloadFormat::Gzip; }
+};
+
+/*
+    lz4 -l, the format of Image.lz4: a magic followed by independent blocks
+    of at most 8 MiB, each prefixed by its compressed size
+*/
+constexpr uint32_t lz4_legacy_magic = 0x184C2102;
+constexpr size_t lz4_legacy_block_size = 8 * 1024 * 1024;
+constexpr size_t lz4_legacy_block_bound = lz4_legacy_block_size + lz4_legacy_block_size / 255 + 16;
+
+static size_t lz4_read_length(const uint8_t*& ip, const uint8_t* iend, size_t length)
+{
+    if (length != 15) {
+        return length;
+    }
+    unsigned b = 255;
+    while (b == 255) {
+        if (ip >= iend) {
+            return SIZE_MAX;
+        }
+        b = *ip++;
+        length += b;
+    }
+    return length;
+}
+
+// returns the decompressed size, -1 for malformed input
+static ssize_t lz4_decompress_block(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_size;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_capacity;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        // literals
+        size_t length = lz4_read_length(ip, iend, token >> 4);
+        if (length > static_cast<size_t>(iend - ip) or length > static_cast<size_t>(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        // the last sequence has no match
+        if (ip >= iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 or offset > static_cast<size_t>(op - dst)) {
+            return -1;
+        }
+
+        length = lz4_read_length(ip, iend, token & 15);
+        if (length == SIZE_MAX) {
+            return -1;
+        }
+        length += 4;
+        if (length > static_cast<size_t>(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t* match = op - offset;
+        if (offset == 1) {
+            // a run of one byte
+            memset(op, *match, length);
+            op += length;
+        } else {
+            // [match, op) repeats the pattern, the window doubles with each copy
+            while (length != 0) {
+                auto n = std::min(length, static_cast<size_t>(op - match));
+                memcpy(op, match, n);
+                op += n;
+                length -= n;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+class Lz4LegacyStream : public PayloadStream {
+    std::unique_ptr<uint8_t[]> _input;
+
+public:
+    Lz4LegacyStream(UniqueFD fd, off_t offset, size_t size)
+        : PayloadStream(std::move(fd), offset, size)
+        , _input(new uint8_t[lz4_legacy_block_bound])
+    {
+        uint32_t magic { 0 };
+        if (read_input(&magic, sizeof(magic)) != sizeof(magic) or le32toh(magic) != lz4_legacy_magic) {
+            throw std::runtime_error { "invalid lz4 legacy stream" };
+        }
+    }
+
+    size_t decompress(ImageBuffer& output, size_t limit) override
+    {
+        while (not _finished and (limit == 0 or output.size() < limit)) {
+            uint32_t chunk_size { 0 };
+            if (read_input(&chunk_size, sizeof(chunk_size)) != sizeof(chunk_size)) {
+                _finished = true;
+                break;
+            }
+            chunk_size = le32toh(chunk_size);
+
+            // concatenated archives
+            if (chunk_size == lz4_legacy_magic) {
+                continue;
+            }
+
+            // there is no end marker, padding or the next section follows
+            if (chunk_size == 0 or chunk_size > lz4_legacy_block_bound) {
+                _finished = true;
+                break;
+            }
+
+            if (read_input(_input.get(), chunk_size) != chunk_size) {
+                throw std::runtime_error { "truncated lz4 stream" };
+            }
+
+            grow(output, lz4_legacy_block_size);
+
+            auto sz = lz4_decompress_block(_input.get(), chunk_size,
+                reinterpret_cast<uint8_t*>(output.data() + output.size()),
+                output.capacity() - output.size());
+            if (sz < 0) {
+                throw std::runtime_error { "failed to decompress lz4 block" };
+            }
+            output.resize(output.size() + sz);
+        }
+
+        if (_finished) {
+            close_input();
+        }
+        return output.size();
+    }
+
+    PayloadFormat format() const override { return PayloadFormat::Lz4Legacy; }
+};
+
+#ifdef KDEPLOY_WITH_ZSTD
+class ZstdStream : public PayloadStream {
+    ZSTD_DStream* _stream;
+    std::unique_ptr<char[]> _input;
+    ZSTD_inBuffer _in {};
+
+public:
+    ZstdStream(UniqueFD fd, off_t offset, size_t size)
+        : PayloadStream(std::move(fd), offset, size)
+        , _stream(ZSTD_createDStream())
+        , _input(new char[input_chunk_size])
+    {
+        if (_stream == nullptr) {
+            throw std::runtime_error { "failed to initialize zstd" };
+        }
+    }
+
+    ~ZstdStream() override
+    {
+        ZSTD_freeDStream(_stream);
+    }
+
+    size_t decompress(ImageBuffer& output, size_t limit) override
+    {
+        while (not _finished and (limit == 0 or output.size() < limit)) {
+            if (_in.pos == _in.size) {
+                auto sz = read_input(_input.get(), input_chunk_size);
+                if (sz == 0) {
+                    throw std::runtime_error { "truncated zstd stream" };
+                }
+                _in = ZSTD_inBuffer { _input.get(), sz, 0 };
+            }
+
+            grow(output, min_output_room);
+
+            ZSTD_outBuffer out { output.data() + output.size(), output.capacity() - output.size(), 0 };
+            auto ret = ZSTD_decompressStream(_stream, &out, &_in);
+            output.resize(output.size() + out.pos);
+
+            if (ZSTD_isError(ret)) {
+                throw std::runtime_error { std::string { "failed to decompress zstd stream: " } + ZSTD_getErrorName(ret) };
+            }
+            if (ret == 0) {
+                _finished = true;
+                close_input();
+            }
+        }
+        return output.size();
+    }
+
+    PayloadFormat format() const override { return PayloadFormat::Zstd; }
+};
+#endif
+
+#ifdef KDEPLOY_WITH_LZMA
+class XzStream : public PayloadStream {
+    lzma_stream _stream = LZMA_STREAM_INIT;
+    std::unique_ptr<uint8_t[]> _input;
+
+public:
+    XzStream(UniqueFD fd, off_t offset, size_t size)
+        : PayloadStream(std::move(fd), offset, size)
+        , _input(new uint8_t[input_chunk_size])
+    {
+        if (lzma_stream_decoder(&_stream, UINT64_MAX, 0) != LZMA_OK) {
+            throw std::runtime_error { "failed to initialize xz" };
+        }
+    }
+
+    ~XzStream() override
+    {
+        lzma_end(&_stream);
+    }
+
+    size_t decompress(ImageBuffer& output, size_t limit) override
+    {
+        while (not _finished and (limit == 0 or output.size() < limit)) {
+            if (_stream.avail_in == 0) {
+                auto sz = read_input(_input.get(), input_chunk_size);
+                if (sz == 0) {
+                    throw std::runtime_error { "truncated xz stream" };
+                }
+                _stream.next_in = _input.get();
+                _stream.avail_in = sz;
+            }
+
+            grow(output, min_output_room);
+
+            auto size = output.size();
+            auto avail = output.capacity() - size;
+
+            _stream.next_out = reinterpret_cast<uint8_t*>(output.data() + size);
+            _stream.avail_out = avail;
+
+            auto ret = lzma_code(&_stream, LZMA_RUN);
+
+            output.resize(size + (avail - _stream.avail_out));
+
+            if (ret == LZMA_STREAM_END) {
+                _finished = true;
+                close_input();
+            } else if (ret != LZMA_OK) {
+                throw std::runtime_error { "failed to decompress xz stream: " + std::to_string(ret) };
+            }
+        }
+        return output.size();
+    }
+
+    PayloadFormat format() const override { return PayloadFormat::Xz; }
+};
+#endif
+
+std::unique_ptr<PayloadStream> open_payload(PayloadFormat format, UniqueFD fd, off_t offset, size_t size)
+{
+    switch (format) {
+    case PayloadFormat::Raw:
+        return std::make_unique<RawStream>(std::move(fd), offset, size);
+    case PayloadFormat::Gzip:
+        return std::make_unique<GzipStream>(std::move(fd), offset, size);
+    case PayloadFormat::Lz4Legacy:
+        return std::make_unique<Lz4LegacyStream>(std::move(fd), offset, size);
+#ifdef KDEPLOY_WITH_ZSTD
+    case PayloadFormat::Zstd:
+        return std::make_unique<ZstdStream>(std::move(fd), offset, size);
+#endif
+#ifdef KDEPLOY_WITH_LZMA
+    case PayloadFormat::Xz:
+        return std::make_unique<XzStream>(std::move(fd), offset, size);
+#endif
+    default:
+        return nullptr;
+    }
+}
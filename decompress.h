@@ -0,0 +1,91 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __decompress_h__
+#define __decompress_h__
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string_view>
+
+#include "buffer.h"
+#include "utils.h"
+
+enum class PayloadFormat {
+    Unknown,
+    Raw,
+    Gzip,
+    Lz4Legacy,
+    Zstd,
+    Xz,
+};
+
+const char* payload_format_name(PayloadFormat format);
+
+/*
+    Resumable kernel payload decompressor.
+
+    decompress() can be called repeatedly with a growing limit, the output
+    buffer grows geometrically and is never zero filled.
+*/
+class PayloadStream {
+    UniqueFD _fd;
+    off_t _offset;
+    off_t _end;
+
+protected:
+    bool _finished { false };
+
+    // read up to `size` bytes of input, 0 at the end of the payload
+    size_t read_input(void* buffer, size_t size);
+
+    // make room for at least `size` more bytes
+    static void grow(ImageBuffer& output, size_t size);
+
+    int input_fd() const { return _fd.get(); }
+
+    void close_input() { _fd.close(); }
+
+public:
+    // `size` bounds the payload, 0 to read until end of file
+    PayloadStream(UniqueFD fd, off_t offset, size_t size);
+    virtual ~PayloadStream() = default;
+
+    PayloadStream(const PayloadStream&) = delete;
+    PayloadStream& operator=(const PayloadStream&) = delete;
+
+    // decompress until `output` holds at least `limit` bytes, 0 for the whole stream.
+    // returns the size of `output`
+    virtual size_t decompress(ImageBuffer& output, size_t limit = 0) = 0;
+
+    virtual PayloadFormat format() const = 0;
+
+    bool finished() const { return _finished; }
+
+    off_t input_offset() const { return _offset; }
+};
+
+// detect the payload format of `data`, which is the start of the payload
+PayloadFormat detect_payload(std::string_view data);
+
+// scan `data` for the start of a kernel payload, returns the offset or -1
+ssize_t find_payload(std::string_view data, PayloadFormat* format);
+
+// returns nullptr if the format is not supported by this build
+std::unique_ptr<PayloadStream> open_payload(PayloadFormat format, UniqueFD fd, off_t offset, size_t size = 0);
+
+#endif
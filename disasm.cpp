@@ -17,6 +17,10 @@
 #include <elf.h>
 #include <link.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <stdexcept>
 #include <vector>
 #include <string>
@@ -26,246 +30,384 @@
 
 #include "kdeploy.h"
 #include "disasm.h"
+#include "arm64_insn.h"
 #include "utils.h"
 
-#if defined(__aarch64__)
-#define CAPSTONE_INIT_OPTS CS_ARCH_ARM64, CS_MODE_ARM
-#elif defined(__x86_64__)
-#define CAPSTONE_INIT_OPTS CS_ARCH_X86, CS_MODE_64
-#else
-#error "Unwupported arch"
-#endif
+Disassembler::Disassembler(KernelInformation& ki, cs_arch arch, cs_mode mode)
+    : _ki(ki)
+    , _arch(arch)
+    , _mode(mode)
+{
+}
 
-bool arm64_decode_movn_movk(cs_insn* insn, size_t count, uint64_t* output)
+Disassembler::Disassembler(KernelInformation& ki)
+    : Disassembler(ki, arch_backend(ki.arch).capstone_arch, arch_backend(ki.arch).capstone_mode)
 {
-    if (count == 0) {
+}
+
+Disassembler::~Disassembler()
+{
+    if (_opened) {
+        cs_free(_plain, 1);
+        cs_free(_detailed, 1);
+        cs_close(&_handle);
+    }
+}
+
+void Disassembler::open()
+{
+    if (_opened) {
+        return;
+    }
+
+    if (cs_open(_arch, _mode, &_handle) != CS_ERR_OK) {
+        throw std::runtime_error { "failed to initialize capstone engine" };
+    }
+
+    // the detail buffer is allocated by cs_malloc while detail is on
+    cs_option(_handle, CS_OPT_DETAIL, CS_OPT_ON);
+    _detailed = cs_malloc(_handle);
+    cs_option(_handle, CS_OPT_DETAIL, CS_OPT_OFF);
+    _plain = cs_malloc(_handle);
+    _opened = true;
+}
+
+uintptr_t Disassembler::end_of(uintptr_t symbol, size_t limit) const
+{
+    auto end = symbol + limit;
+
+    auto next = _ki.kallsyms.next_address(symbol);
+    if (next != 0 and next < end) {
+        end = next;
+    }
+
+    auto image_end = _ki.sym_text + _ki.buffer.size();
+    if (symbol < _ki.sym_text or symbol >= image_end) {
+        throw std::runtime_error { "function out of the kernel image" };
+    }
+    return std::min(end, image_end);
+}
+
+Disassembler::Function& Disassembler::function(uintptr_t symbol, size_t limit)
+{
+    auto end = end_of(symbol, limit);
+
+    auto& func = _functions[symbol];
+    func.end = std::max(func.end, end);
+    return func;
+}
+
+bool Disassembler::decode_next(Function& func, uintptr_t symbol)
+{
+    if (func.invalid) {
         return false;
     }
 
-    if (insn[0].id != ARM64_INS_MOVN) {
+    uint64_t address = symbol;
+    if (not func.insns.empty()) {
+        address = func.insns.back().address + func.insns.back().size;
+    }
+    if (address >= func.end) {
         return false;
     }
 
-    uint64_t val = 0;
+    open();
 
-    val = (~static_cast<uintptr_t>(insn[0].detail->arm64.operands[1].imm));
-    val <<= insn[0].detail->arm64.operands[1].shift.value;
+    auto* code = reinterpret_cast<const uint8_t*>(_ki.buffer.data() + (address - _ki.sym_text));
+    size_t size = func.end - address;
 
-    for (size_t i = 1; i < count and insn[i].id == ARM64_INS_MOVK; ++i) {
-        auto imm = insn[i].detail->arm64.operands[1].imm;
-        imm <<= insn[i].detail->arm64.operands[1].shift.value;
-        val |= imm;
+    if (not cs_disasm_iter(_handle, &code, &size, &address, _plain)) {
+        func.invalid = true;
+        return false;
     }
 
-    *output = val;
+    func.insns.push_back({ _plain->address, _plain->id, _plain->size });
     return true;
 }
 
-std::tuple<uintptr_t, uintptr_t> get_module_layout(uint8_t* sys_delete_module)
+const std::vector<DisasmInsn>& Disassembler::decode(uintptr_t symbol, size_t limit)
 {
-    csh handle {};
-    cs_insn* insn { nullptr };
+    auto& func = function(symbol, limit);
+    while (decode_next(func, symbol)) {
+    }
+    return func.insns;
+}
 
-    if (cs_open(CAPSTONE_INIT_OPTS, &handle) != CS_ERR_OK) {
-        throw std::runtime_error { "failed to initialize capstone engine" };
+const cs_insn& Disassembler::detail(const DisasmInsn& insn)
+{
+    open();
+
+    auto* code = reinterpret_cast<const uint8_t*>(_ki.buffer.data() + (insn.address - _ki.sym_text));
+    size_t size = insn.size;
+    uint64_t address = insn.address;
+
+    cs_option(_handle, CS_OPT_DETAIL, CS_OPT_ON);
+    auto decoded = cs_disasm_iter(_handle, &code, &size, &address, _detailed);
+    cs_option(_handle, CS_OPT_DETAIL, CS_OPT_OFF);
+
+    if (not decoded) {
+        throw std::runtime_error { "failed to decode instruction" };
     }
+    return *_detailed;
+}
 
-    auto release_capstone_handle = ScopeTail([&]() {
-        cs_close(&handle);
-    });
+std::basic_string_view<uint32_t> Disassembler::words(uintptr_t symbol, size_t limit) const
+{
+    auto end = end_of(symbol, limit);
+    auto* code = reinterpret_cast<const uint32_t*>(_ki.buffer.data() + (symbol - _ki.sym_text));
+    return { code, (end - symbol) / sizeof(uint32_t) };
+}
+
+const ArchBackend& arch_backend(KernelArch arch)
+{
+    static const ArchBackend arm64 {
+        KernelArch::Arm64,
+        "arm64",
+        CS_ARCH_ARM64,
+        CS_MODE_ARM,
+        arm64_get_module_layout,
+        arm64_get_kernel_symbol_size,
+        arm64_get_mm_pgd_offset,
+        arm64_relocate_kernel,
+    };
 
-    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+    // the image is analysed at its link address
+    static const ArchBackend x86_64 {
+        KernelArch::X86_64,
+        "x86_64",
+        CS_ARCH_X86,
+        CS_MODE_64,
+        x86_get_module_layout,
+        x86_get_kernel_symbol_size,
+        nullptr,
+        nullptr,
+    };
+
+    switch (arch) {
+    case KernelArch::X86_64:
+        return x86_64;
+    default:
+        return arm64;
+    }
+}
+
+KernelArch detect_kernel_arch(KernelInformation& ki)
+{
+    // arm64 Image header, magic at 0x38
+    constexpr size_t arm64_magic_offset = 0x38;
+    constexpr uint32_t arm64_magic = 0x644d5241; // "ARM\x64"
+
+    uint32_t magic { 0 };
+    if (ki.buffer.size() >= arm64_magic_offset + sizeof(magic)) {
+        memcpy(&magic, ki.buffer.data() + arm64_magic_offset, sizeof(magic));
+        if (magic == arm64_magic) {
+            return KernelArch::Arm64;
+        }
+    }
+
+    if (ki.find_symbol("startup_64") != 0) {
+        return KernelArch::X86_64;
+    }
+
+    // arm64 kernels before 3.12 have no magic
+    return KernelArch::Arm64;
+}
 
+std::tuple<uintptr_t, uintptr_t> get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module)
+{
+    return arch_backend(disasm.kernel_arch()).module_layout(disasm, sys_delete_module);
+}
+
+size_t get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym)
+{
+    return arch_backend(disasm.kernel_arch()).kernel_symbol_size(disasm, sym_module_get_kallsym);
+}
+
+std::tuple<uintptr_t, uintptr_t> x86_get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module)
+{
     constexpr size_t max_insn = 256;
 
-    auto count = cs_disasm(handle,
-        sys_delete_module, 0x1000,
-        0x1000, max_insn, &insn);
-    if (count == 0) {
+    auto& insns = disasm.decode(sys_delete_module, 0x1000);
+    if (insns.empty()) {
         throw std::runtime_error { "failed to disassemble sys_delete_module" };
     }
     /*
-        arm64
-        0xffffff93023620c0:     ldr             x8, [x23, #0x150]
-        0xffffff93023620c4:     cbz             x8, #0xffffff93023620e0
-        0xffffff93023620c8:     ldr             x8, [x23, #0x2f8]
-        0xffffff93023620cc:     cbnz            x8, #0xffffff93023620e0
-
         x86_64
         0xffffffff81197523:  cmp             qword ptr [rbx + 0x138], 0
         0xffffffff8119752b:  je              0xffffffff8119753b
         0xffffffff8119752d:  cmp             qword ptr [rbx + 0x338], 0
         0xffffffff81197535:  je              0xffffffff8119768b
     */
-    std::vector<int32_t> disps {};
-    disps.reserve(max_insn);
+    auto count = std::min(insns.size(), max_insn);
 
     std::basic_string<unsigned int> opcodes {};
-    opcodes.reserve(max_insn);
+    opcodes.reserve(count);
 
     for (size_t i = 0; i < count; ++i) {
-        auto& instruction = insn[i];
+        opcodes.push_back(insns[i].id);
+    }
 
-        opcodes.push_back(instruction.id);
+    // only the matched instructions are decoded with their operands
+    auto disp_of = [&](size_t i) -> int32_t {
+        auto& instruction = disasm.detail(insns.at(i));
 
-        // printf("%zu 0x%" PRIx64 ":\t%s\t\t%s\n", i, insn[i].address, insn[i].mnemonic, insn[i].op_str);
+        // printf("%zu 0x%" PRIx64 ":\t%s\t\t%s\n", i, instruction.address, instruction.mnemonic, instruction.op_str);
 
-#if defined(__aarch64__)
-        if (ARM64_INS_LDR == instruction.id
-            and instruction.detail->arm64.op_count == 2
-            and instruction.detail->arm64.operands[1].type == ARM64_OP_MEM) {
-            disps.push_back(instruction.detail->arm64.operands[1].mem.disp);
-            continue;
-        }
-        if (ARM64_INS_CMP == instruction.id
-            and instruction.detail->arm64.op_count == 2
-            and instruction.detail->arm64.operands[1].type == ARM64_OP_IMM) {
-            disps.push_back(instruction.detail->arm64.operands[1].imm);
-            continue;
-        }
-#elif defined(__x86_64__)
         if (X86_INS_CMP == instruction.id
             and instruction.detail->x86.op_count == 2
             and instruction.detail->x86.operands[0].type == X86_OP_MEM) {
-            disps.push_back(instruction.detail->x86.operands[0].mem.disp);
-            continue;
+            return instruction.detail->x86.operands[0].mem.disp;
         }
-#else
-#error "Unwupported arch"
-#endif
 
-        disps.push_back(0);
-    }
-    cs_free(insn, count);
+        return 0;
+    };
 
-#if defined(__aarch64__)
-    std::array<unsigned int, 4> acces_mod_init_exit { ARM64_INS_LDR, ARM64_INS_CBZ, ARM64_INS_LDR, ARM64_INS_CBNZ };
-#elif defined(__x86_64__)
     std::array<unsigned int, 4> acces_mod_init_exit { X86_INS_CMP, X86_INS_JE, X86_INS_CMP, X86_INS_JE };
-#else
-#error "Unwupported arch"
-#endif
     auto pos = opcodes.find(std::basic_string_view<unsigned int> { acces_mod_init_exit.data(), acces_mod_init_exit.size() });
     if (pos == decltype(opcodes)::npos) {
         throw std::runtime_error { "Instructions not found" };
     }
 
-    auto init_offset = disps.at(pos);
-    auto exit_offset = disps.at(pos + 2);
-
-#if defined(__aarch64__)
-    {
-        std::array<unsigned int, 2> access_mod_state { ARM64_INS_LDR, ARM64_INS_CMP };
-        size_t pos = 0;
-        while (true) {
-            pos = opcodes.find(std::basic_string_view<unsigned int> { access_mod_state.data(), access_mod_state.size() }, pos);
-            if (pos == decltype(opcodes)::npos) {
-                break;
-            }
-            if (disps.at(pos) == -8 and disps.at(pos + 1) == 3) {
-                init_offset += 8;
-                exit_offset += 8;
-            }
-            pos += 2;
-        }
-    }
-#endif
-
-    return { init_offset, exit_offset };
+    return { disp_of(pos), disp_of(pos + 2) };
 }
 
-size_t get_kernel_symbol_size(uint8_t* sym_module_get_kallsym)
+size_t x86_get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym)
 {
-    csh handle {};
-    cs_insn* insn { nullptr };
-
-    if (cs_open(CAPSTONE_INIT_OPTS, &handle) != CS_ERR_OK) {
-        throw std::runtime_error { "failed to initialize capstone engine" };
-    }
-
-    auto release_capstone_handle = ScopeTail([&]() {
-        cs_close(&handle);
-    });
-
-    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
-
     constexpr size_t max_insn = 256;
 
-    auto count = cs_disasm(handle, sym_module_get_kallsym, 0x1000,
-        0, max_insn, &insn);
-    if (count == 0) {
-        throw std::runtime_error { "failed to disassemble sym_module_get_kallsym" };
-    }
-
     /*
-        arm64
-        mov     x3, xx
-
         x86_64
         mov     ecx, 18h
     */
     size_t kernel_symbol_size = 0;
+    size_t count = 0;
 
-    for (size_t i = 0; i < count; ++i) {
-        auto& instruction = insn[i];
-
-        // printf("%zu 0x%" PRIx64 ":\t%s\t\t%s\n", i, insn[i].address, insn[i].mnemonic, insn[i].op_str);
+    disasm.walk(sym_module_get_kallsym, 0x1000, [&](const DisasmInsn& insn) {
+        if (++count > max_insn) {
+            return true;
+        }
 
-#if defined(__aarch64__)
-        if (ARM64_INS_MOV == instruction.id
-            and instruction.detail->arm64.op_count == 2
-            and instruction.detail->arm64.operands[0].type == ARM64_OP_REG
-            and instruction.detail->arm64.operands[0].reg == ARM64_REG_X3
-            and instruction.detail->arm64.operands[1].type == ARM64_OP_IMM) {
-            kernel_symbol_size = instruction.detail->arm64.operands[1].imm;
-            break;
+        if (X86_INS_MOV != insn.id) {
+            return false;
         }
-#elif defined(__x86_64__)
-        if (X86_INS_MOV == instruction.id
-            and instruction.detail->x86.op_count == 2
+
+        auto& instruction = disasm.detail(insn);
+        if (instruction.detail->x86.op_count == 2
             and instruction.detail->x86.operands[0].type == X86_OP_REG
             and instruction.detail->x86.operands[0].reg == X86_REG_ECX
             and instruction.detail->x86.operands[1].type == X86_OP_IMM) {
             kernel_symbol_size = instruction.detail->x86.operands[1].imm;
-            break;
+            return true;
         }
-#else
-#error "Unwupported arch"
-#endif
+        return false;
+    });
+
+    if (count == 0) {
+        throw std::runtime_error { "failed to disassemble sym_module_get_kallsym" };
     }
-    cs_free(insn, count);
 
     return kernel_symbol_size;
 }
 
-void arm64_relocate_kernel(KernelInformation& ki, uint8_t* __relocate_kernel)
+std::tuple<uintptr_t, uintptr_t> arm64_get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module)
 {
-    csh handle {};
-    cs_insn* insn { nullptr };
+    constexpr size_t max_insn = 256;
 
-    if (cs_open(CS_ARCH_ARM64, CS_MODE_ARM, &handle) != CS_ERR_OK) {
-        throw std::runtime_error { "failed to initialize capstone engine" };
+    auto code = disasm.words(sys_delete_module, 0x1000);
+    if (code.empty()) {
+        throw std::runtime_error { "failed to disassemble sys_delete_module" };
     }
+    /*
+        0xffffff93023620c0:     ldr             x8, [x23, #0x150]
+        0xffffff93023620c4:     cbz             x8, #0xffffff93023620e0
+        0xffffff93023620c8:     ldr             x8, [x23, #0x2f8]
+        0xffffff93023620cc:     cbnz            x8, #0xffffff93023620e0
+    */
+    std::vector<Arm64Insn> insns {};
+    insns.reserve(std::min(code.size(), max_insn));
 
-    auto release_capstone_handle = ScopeTail([&]() {
-        cs_close(&handle);
-    });
+    for (size_t i = 0; i < code.size() and i < max_insn; ++i) {
+        insns.push_back(arm64_decode(code[i], sys_delete_module + i * sizeof(uint32_t)));
+    }
 
-    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+    auto match = [&](size_t pos, std::initializer_list<Arm64Op> ops) {
+        if (pos + ops.size() > insns.size()) {
+            return false;
+        }
+        for (auto op : ops) {
+            if (insns[pos++].op != op) {
+                return false;
+            }
+        }
+        return true;
+    };
 
-    constexpr size_t max_insn = 10;
+    size_t pos = 0;
+    while (pos < insns.size() and not match(pos, { Arm64Op::Ldr, Arm64Op::Cbz, Arm64Op::Ldr, Arm64Op::Cbnz })) {
+        ++pos;
+    }
+    if (pos == insns.size()) {
+        throw std::runtime_error { "Instructions not found" };
+    }
 
-    struct Aarch64KernelHeader {
-        void* b;
-        uint64_t offset;
-    };
+    auto init_offset = insns[pos].imm;
+    auto exit_offset = insns[pos + 2].imm;
 
-    auto count = cs_disasm(handle, __relocate_kernel, 0x1000,
-        reinterpret_cast<uint64_t>(__relocate_kernel), max_insn, &insn);
-    if (count == 0) {
-        throw std::runtime_error { "failed to disassemble __relocate_kernel" };
+    // ldr [x, #-8]; cmp #3, the init/exit offsets are taken relative to mod->state
+    for (pos = 0; pos + 1 < insns.size(); ++pos) {
+        if (match(pos, { Arm64Op::Ldr, Arm64Op::CmpImm }) and insns[pos].imm == -8 and insns[pos + 1].imm == 3) {
+            init_offset += 8;
+            exit_offset += 8;
+            ++pos;
+        }
+    }
+
+    return { init_offset, exit_offset };
+}
+
+size_t arm64_get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym)
+{
+    constexpr size_t max_insn = 256;
+
+    /*
+        mov     x3, xx
+    */
+    auto code = disasm.words(sym_module_get_kallsym, 0x1000);
+    if (code.empty()) {
+        throw std::runtime_error { "failed to disassemble sym_module_get_kallsym" };
+    }
+
+    for (size_t i = 0; i < code.size() and i < max_insn; ++i) {
+        auto insn = arm64_decode(code[i], sym_module_get_kallsym + i * sizeof(uint32_t));
+        if ((insn.op == Arm64Op::Movz or insn.op == Arm64Op::Movn) and insn.rd == 3 and insn.wide) {
+            return arm64_mov_wide(insn, 0);
+        }
     }
 
+    return 0;
+}
+
+static bool arm64_looks_like_rela(const uint8_t* table, size_t size)
+{
+    if (size == 0 or size % sizeof(ElfW(Rela)) != 0) {
+        return false;
+    }
+
+    // a RELR table starts with an address, then mostly odd bitmaps
+    auto* rela = reinterpret_cast<const ElfW(Rela)*>(table);
+    auto count = std::min<size_t>(size / sizeof(ElfW(Rela)), 16);
+    for (size_t i = 0; i < count; ++i) {
+        if (ELF64_R_TYPE(rela[i].r_info) != R_AARCH64_RELATIVE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void arm64_decode_relocate_kernel(KernelInformation& ki, Disassembler& disasm, uintptr_t __relocate_kernel, Arm64Relocation& reloc)
+{
+    constexpr size_t max_insn = 64;
+
     /*
         old kernel
         ldr w9, =rela_offset # _head + (rela - _head) , _head = 0x8000 = hdr->offset
@@ -275,105 +417,398 @@ void arm64_relocate_kernel(KernelInformation& ki, uint8_t* __relocate_kernel)
         movn            x11, #0x7f, lsl #32
         movk            x11, #0x800, lsl #16
         movk            x11, #0
-
-        6.x
-        adr x9, relr_start
-        adr x10, relr_end
+        ...
+        ldr w9, =relr_offset # CONFIG_RELR
+        ldr w10, =relr_size
+
+        5.x/6.x
+        adr(p) x9, rela_start
+        [add x9, x9, :lo12:rela_start]
+        adr(p) x10, rela_end
+        [add x10, x10, :lo12:rela_end]
+        mov_q x11, KIMAGE_VADDR
+        ...
+        adr(p) x9, relr_start
+        adr(p) x10, relr_end
+
+        Every x9/x10 pair is a table, the content tells RELA from RELR.
     */
+    struct Table {
+        uintptr_t offset;
+        uintptr_t size;
+    };
+    std::vector<Table> tables {};
+
+    uint64_t x9 { 0 };
+    uint64_t x10 { 0 };
+    unsigned loaded { 0 };
+    bool literal { false };
+
+    uint64_t default_base { 0 };
+    bool in_mov_q { false };
+    bool mov_q_done { false };
+
+    // literal pools and adr targets, as offsets in the image
+    auto offset_of = [&](uint64_t address) -> uintptr_t {
+        auto offset = address - ki.sym_text;
+        if (offset + sizeof(uint32_t) > ki.buffer.size()) {
+            throw std::runtime_error { "__relocate_kernel reference out of the kernel image" };
+        }
+        return offset;
+    };
+
+    auto flush = [&]() {
+        if (loaded != 3) {
+            return;
+        }
+        if (literal) {
+            tables.push_back({ x9 - ki.load_offset, x10 });
+        } else if (x10 >= x9) {
+            tables.push_back({ x9, x10 - x9 });
+        }
+        loaded = 0;
+    };
+
+    size_t count = 0;
+
+    auto code = disasm.words(__relocate_kernel, max_insn * sizeof(uint32_t));
+
+    for (; count < code.size(); ++count) {
+        auto insn = arm64_decode(code[count], __relocate_kernel + count * sizeof(uint32_t));
+
+        // printf("0x%" PRIx64 ":\t%08x\n", __relocate_kernel + count * 4, code[count]);
+
+        if (insn.op == Arm64Op::Ret) {
+            break;
+        }
+
+        uint64_t* target { nullptr };
+        unsigned bit { 0 };
+        if (insn.rd == 9) {
+            target = &x9;
+            bit = 1;
+        } else if (insn.rd == 10) {
+            target = &x10;
+            bit = 2;
+        }
+
+        if (target != nullptr and (insn.op == Arm64Op::Adr or insn.op == Arm64Op::Adrp)) {
+            *target = insn.imm - ki.sym_text;
+            literal = false;
+            loaded |= bit;
+            continue;
+        }
+
+        if (target != nullptr and insn.op == Arm64Op::LdrLiteral) {
+            uint32_t value { 0 };
+            memcpy(&value, ki.buffer.data() + offset_of(insn.imm), sizeof(value));
+            *target = value;
+            literal = true;
+            loaded |= bit;
+            continue;
+        }
+
+        if (target != nullptr and not literal and (loaded & bit)
+            and insn.op == Arm64Op::AddImm and insn.rn == insn.rd) {
+            *target += insn.imm;
+            continue;
+        }
+
+        if (insn.rd == 11 and not mov_q_done
+            and (insn.op == Arm64Op::Movz or insn.op == Arm64Op::Movn or (in_mov_q and insn.op == Arm64Op::Movk))) {
+            default_base = arm64_mov_wide(insn, default_base);
+            in_mov_q = true;
+            continue;
+        }
+        mov_q_done = mov_q_done or in_mov_q;
+
+        flush();
+    }
+
+    if (count == 0) {
+        throw std::runtime_error { "failed to disassemble __relocate_kernel" };
+    }
+    flush();
+
+    for (auto& table : tables) {
+        if (table.size == 0) {
+            continue;
+        }
+
+        if (table.offset > ki.buffer.size() or table.size > ki.buffer.size() - table.offset) {
+            throw std::runtime_error { "relocation table out of the kernel image" };
+        }
+
+        if (arm64_looks_like_rela(ki.ptr(table.offset), table.size)) {
+            reloc.rela_offset = table.offset;
+            reloc.rela_size = table.size;
+        } else if (table.size % sizeof(uint64_t) == 0) {
+            reloc.relr_offset = table.offset;
+            reloc.relr_size = table.size;
+        }
+    }
+
+    if (tables.empty()) {
+        throw std::runtime_error { "unsupported __relocate_kernel" };
+    }
+
+    reloc.default_base = default_base;
+}
+
+// [start, end) of a relocation table from the linker symbols, relative to _head
+static void arm64_relocation_table(KernelInformation& ki, const char* start, const char* end, uintptr_t& offset, uintptr_t& size)
+{
+    auto sym_start = ki.find_symbol(start);
+    auto sym_end = ki.find_symbol(end);
+    if (sym_start == 0 or sym_end < sym_start) {
+        return;
+    }
+
+    offset = ki.offset(sym_start);
+    size = sym_end - sym_start;
+
+    if (offset > ki.buffer.size() or size > ki.buffer.size() - offset) {
+        throw std::runtime_error { "relocation table out of the kernel image" };
+    }
+}
+
+Arm64Relocation arm64_get_relocation(KernelInformation& ki, Disassembler& disasm)
+{
+    Arm64Relocation reloc {};
+
+    auto __relocate_kernel = ki.find_symbol("__relocate_kernel");
+    if (__relocate_kernel != 0) {
+        arm64_decode_relocate_kernel(ki, disasm, __relocate_kernel, reloc);
+    } else {
+        // 6.4 and later relocate in C (pi/relocate.c)
+        arm64_relocation_table(ki, "__rela_start", "__rela_end", reloc.rela_offset, reloc.rela_size);
+        arm64_relocation_table(ki, "__relr_start", "__relr_end", reloc.relr_offset, reloc.relr_size);
+        if (reloc.rela_size == 0 and reloc.relr_size == 0) {
+            throw std::runtime_error { "kernel relocation tables not found" };
+        }
+    }
 
-    if (ARM64_INS_ADR == insn[0].id) {
-        throw std::runtime_error { "TODO __relocate_kernel with ADR" };
-
-    } else if (ARM64_INS_LDR == insn[0].id) {
-        auto rela_offset = *reinterpret_cast<uint32_t*>(insn[0].detail->arm64.operands[1].imm) - ki.load_offset; // relative to _head
-        auto rela_size = *reinterpret_cast<uint32_t*>(insn[1].detail->arm64.operands[1].imm);
-        uint64_t default_base = 0; // KIMAGE_VADDR
-
-        arm64_decode_movn_movk(&insn[2], 3, &default_base);
-
-        uintptr_t kaslr = (reinterpret_cast<uintptr_t>(ki.buffer.data()) - ki.load_offset) - default_base;
-
-        BOOST_LOG_TRIVIAL(debug) << "kernel load offset " << (void*)(uintptr_t)ki.load_offset;
-        BOOST_LOG_TRIVIAL(debug) << "kernel rela_offset " << (void*)(uintptr_t)rela_offset;
-        BOOST_LOG_TRIVIAL(debug) << "kernel rela_size " << (void*)(uintptr_t)rela_size;
-        BOOST_LOG_TRIVIAL(debug) << "kernel default_base " << (void*)(uintptr_t)default_base;
-        BOOST_LOG_TRIVIAL(debug) << "kernel kaslr  " << (void*)kaslr;
-
-        auto* iter = ki.ptr<ElfW(Rela)*>(rela_offset);
-        auto* end = ki.ptr<ElfW(Rela)*>(rela_offset + rela_size);
-
-        ki.ARCH_RELOCATES_KCRCTAB = true;
-        ki.kaslr = kaslr;
-        ki.default_base = default_base;
-
-        for (; iter < end; ++iter) {
-            auto* loc = reinterpret_cast<uint64_t*>(iter->r_offset + kaslr);
-            auto val = static_cast<uint64_t>(iter->r_addend + kaslr);
-            switch (iter->r_info) {
-            case R_AARCH64_RELATIVE:
-                memcpy(loc, &val, sizeof(val));
-                break;
-            default:
-                BOOST_LOG_TRIVIAL(warning) << "Unsupported relocation type " << iter->r_info;
-                break;
+    if (reloc.default_base == 0 and reloc.relr_size != 0) {
+        // RELR leaves the link time value in place, kimage_vaddr = _text = KIMAGE_VADDR (+ TEXT_OFFSET before 5.8)
+        auto kimage_vaddr = ki.find_symbol("kimage_vaddr");
+        if (kimage_vaddr != 0) {
+            memcpy(&reloc.default_base, ki.ptr_of_sym(kimage_vaddr), sizeof(reloc.default_base));
+        }
+    }
+
+    if (reloc.default_base == 0) {
+        throw std::runtime_error { "KIMAGE_VADDR not found" };
+    }
+
+    return reloc;
+}
+
+constexpr size_t no_rela = SIZE_MAX;
+
+/*
+    Call `func(offset, rela)` for every word the tables relocate. `rela`
+    is the RELA entry index, or no_rela for RELR words that get kaslr
+    added to their link time value. Returns the count of skipped RELA
+    entries.
+
+    RELR: an even entry is the address of a word to relocate, an odd
+    entry is a bitmap of the 63 words following the last address.
+    Bitmaps are walked by their set bits only.
+*/
+template <typename F>
+static size_t arm64_walk_relocation(const uint8_t* image, size_t size, uintptr_t link_base, const Arm64Relocation& reloc, F&& func)
+{
+    auto* rela = reinterpret_cast<const ElfW(Rela)*>(image + reloc.rela_offset);
+    size_t rela_count = reloc.rela_size / sizeof(ElfW(Rela));
+
+    size_t unsupported = 0;
+
+    for (size_t i = 0; i < rela_count; ++i) {
+        if (ELF64_R_TYPE(rela[i].r_info) != R_AARCH64_RELATIVE) {
+            ++unsupported;
+            continue;
+        }
+
+        auto offset = rela[i].r_offset - link_base;
+        if (offset > size - sizeof(uint64_t)) {
+            throw std::runtime_error { "RELA entry out of the kernel image" };
+        }
+
+        func(offset, i);
+    }
+
+    auto* relr = reinterpret_cast<const uint64_t*>(image + reloc.relr_offset);
+    auto* relr_end = reinterpret_cast<const uint64_t*>(image + reloc.relr_offset + reloc.relr_size);
+
+    size_t word_count = size / sizeof(uint64_t);
+    size_t next = 0; // the word after the last address entry
+
+    for (; relr < relr_end; ++relr) {
+        auto entry = *relr;
+
+        if ((entry & 1) == 0) {
+            auto offset = entry - link_base;
+            if ((offset % sizeof(uint64_t)) != 0 or offset / sizeof(uint64_t) >= word_count) {
+                throw std::runtime_error { "RELR entry out of the kernel image" };
+            }
+            func(offset, no_rela);
+            next = offset / sizeof(uint64_t) + 1;
+            continue;
+        }
+
+        auto bits = entry >> 1;
+        if (bits != 0) {
+            size_t last = next + (63 - __builtin_clzll(bits));
+            if (last >= word_count) {
+                throw std::runtime_error { "RELR bitmap out of the kernel image" };
+            }
+
+            for (; bits != 0; bits &= bits - 1) {
+                func((next + __builtin_ctzll(bits)) * sizeof(uint64_t), no_rela);
             }
         }
+        next += 63;
+    }
 
+    return unsupported;
+}
+
+static void arm64_relocate_word(uint8_t* image, const ElfW(Rela)* rela, size_t offset, size_t index, uintptr_t kaslr)
+{
+    auto* word = reinterpret_cast<uint64_t*>(image + offset);
+    if (index == no_rela) {
+        *word += kaslr;
     } else {
-        throw std::runtime_error { "unsupported __relocate_kernel" };
+        *word = static_cast<uint64_t>(rela[index].r_addend + kaslr);
     }
+}
+
+void arm64_apply_relocation(uint8_t* image, size_t size, uintptr_t load_offset, const Arm64Relocation& reloc, uintptr_t kaslr)
+{
+    auto* rela = reinterpret_cast<const ElfW(Rela)*>(image + reloc.rela_offset);
 
-    // for (size_t i = 0; i < count; ++i) {
-    //     printf("%zu 0x%" PRIx64 ":\t%s\t\t%s\n", i, insn[i].address, insn[i].mnemonic, insn[i].op_str);
-    // }
+    auto unsupported = arm64_walk_relocation(image, size, reloc.default_base + load_offset, reloc,
+        [&](size_t offset, size_t index) {
+            arm64_relocate_word(image, rela, offset, index, kaslr);
+        });
 
-    cs_free(insn, count);
+    if (unsupported != 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Unsupported relocation type, " << unsupported << " entries skipped";
+    }
 }
 
-uintptr_t arm64_get_mm_pgd_offset(uint8_t* create_pgd_mapping)
+Arm64LazyRelocation::Arm64LazyRelocation(uint8_t* image, size_t size, uintptr_t load_offset, const Arm64Relocation& reloc, uintptr_t kaslr)
+    : _image(image)
+    , _rela(reinterpret_cast<const ElfW(Rela)*>(image + reloc.rela_offset))
+    , _kaslr(kaslr)
 {
-    csh handle {};
-    cs_insn* insn { nullptr };
+    if (size > UINT32_MAX) {
+        throw std::runtime_error { "kernel image too large" };
+    }
 
-    if (cs_open(CAPSTONE_INIT_OPTS, &handle) != CS_ERR_OK) {
-        throw std::runtime_error { "failed to initialize capstone engine" };
+    uintptr_t link_base = reloc.default_base + load_offset;
+    size_t page_count = (size + page_size - 1) / page_size;
+
+    // count, then place the entries by page
+    _pages.assign(page_count + 1, 0);
+
+    auto unsupported = arm64_walk_relocation(image, size, link_base, reloc,
+        [&](size_t offset, size_t) {
+            ++_pages[offset / page_size + 1];
+        });
+
+    for (size_t i = 1; i <= page_count; ++i) {
+        _pages[i] += _pages[i - 1];
     }
 
-    auto release_capstone_handle = ScopeTail([&]() {
-        cs_close(&handle);
-    });
+    _entries.resize(_pages[page_count]);
+    std::vector<uint32_t> fill { _pages.begin(), _pages.end() - 1 };
 
-    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+    arm64_walk_relocation(image, size, link_base, reloc,
+        [&](size_t offset, size_t index) {
+            _entries[fill[offset / page_size]++] = { static_cast<uint32_t>(offset), static_cast<uint32_t>(index) };
+        });
 
-    constexpr size_t max_insn = 24;
+    _relocated.assign(page_count, false);
 
-    auto count = cs_disasm(handle, create_pgd_mapping, 0x1000, 0, max_insn, &insn);
-    if (count == 0) {
-        throw std::runtime_error { "failed to disassemble create_pgd_mapping" };
+    if (unsupported != 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Unsupported relocation type, " << unsupported << " entries skipped";
     }
 
+    BOOST_LOG_TRIVIAL(debug) << "relocation entries " << _entries.size() << " pages " << page_count;
+}
+
+void Arm64LazyRelocation::apply(size_t offset, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    auto first = offset / page_size;
+    auto last = std::min((offset + size - 1) / page_size + 1, _relocated.size());
+
+    for (auto page = first; page < last; ++page) {
+        if (_relocated[page]) {
+            continue;
+        }
+
+        for (auto i = _pages[page]; i < _pages[page + 1]; ++i) {
+            auto& entry = _entries[i];
+            arm64_relocate_word(_image, _rela, entry.offset,
+                entry.rela == UINT32_MAX ? no_rela : entry.rela, _kaslr);
+        }
+
+        _relocated[page] = true;
+    }
+}
+
+void arm64_relocate_kernel(KernelInformation& ki, Disassembler& disasm)
+{
+    auto reloc = arm64_get_relocation(ki, disasm);
+
+    uintptr_t kaslr = (reinterpret_cast<uintptr_t>(ki.buffer.data()) - ki.load_offset) - reloc.default_base;
+
+    BOOST_LOG_TRIVIAL(debug) << "kernel load offset " << (void*)(uintptr_t)ki.load_offset;
+    BOOST_LOG_TRIVIAL(debug) << "kernel rela_offset " << (void*)(uintptr_t)reloc.rela_offset;
+    BOOST_LOG_TRIVIAL(debug) << "kernel rela_size " << (void*)(uintptr_t)reloc.rela_size;
+    BOOST_LOG_TRIVIAL(debug) << "kernel relr_offset " << (void*)(uintptr_t)reloc.relr_offset;
+    BOOST_LOG_TRIVIAL(debug) << "kernel relr_size " << (void*)(uintptr_t)reloc.relr_size;
+    BOOST_LOG_TRIVIAL(debug) << "kernel default_base " << (void*)(uintptr_t)reloc.default_base;
+    BOOST_LOG_TRIVIAL(debug) << "kernel kaslr  " << (void*)kaslr;
+
+    // kcrctab holds plain values since 4.11, they are no longer relocated
+    ki.ARCH_RELOCATES_KCRCTAB = ki.version_old_then(4, 11, 0);
+    ki.kaslr = kaslr;
+    ki.default_base = reloc.default_base;
+
+    // pages are relocated as ptr_of_sym/ptr hand them out
+    auto lazy = std::make_shared<Arm64LazyRelocation>(
+        reinterpret_cast<uint8_t*>(ki.buffer.data()), ki.buffer.size(), ki.load_offset, reloc, kaslr);
+
+    ki.relocate = [lazy](size_t offset, size_t size) {
+        lazy->apply(offset, size);
+    };
+}
+
+uintptr_t arm64_get_mm_pgd_offset(Disassembler& disasm, uintptr_t create_pgd_mapping)
+{
+    constexpr size_t max_insn = 24;
+
     /*
         arm64
         LDR             X0, [X0,#0x48]
     */
     ssize_t pgd_offset = -1;
 
-    for (size_t i = 0; i < count; ++i) {
-        auto& instruction = insn[i];
-
-        // printf("%zu 0x%" PRIx64 ":\t%s\t\t%s\n", i, insn[i].address, insn[i].mnemonic, insn[i].op_str);
-        // fflush(stdout);
+    auto code = disasm.words(create_pgd_mapping, max_insn * sizeof(uint32_t));
 
-        if (ARM64_INS_LDR == instruction.id
-            and instruction.detail->arm64.op_count == 2
-            and instruction.detail->arm64.operands[0].type == ARM64_OP_REG
-            and instruction.detail->arm64.operands[0].reg == ARM64_REG_X0
-            and instruction.detail->arm64.operands[1].type == ARM64_OP_MEM) {
-            pgd_offset = instruction.detail->arm64.operands[1].mem.disp;
+    for (size_t i = 0; i < code.size(); ++i) {
+        auto insn = arm64_decode(code[i], create_pgd_mapping + i * sizeof(uint32_t));
+        if (insn.op == Arm64Op::Ldr and insn.rd == 0 and insn.wide) {
+            pgd_offset = insn.imm;
             break;
         }
     }
-    cs_free(insn, count);
 
     if (pgd_offset == -1) {
         throw std::runtime_error { "pgd offset not found s" };
@@ -17,18 +17,175 @@
 #ifndef __disasm_h__
 #define __disasm_h__
 
+#include <elf.h>
+
+#include <string_view>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include "capstone/capstone.h"
 
 #include "kdeploy.h"
 
-std::tuple<uintptr_t, uintptr_t> get_module_layout(uint8_t* sys_delete_module);
+struct DisasmInsn {
+    uint64_t address;
+    uint32_t id;
+    uint16_t size;
+};
+
+/*
+    Disassembly shared by the analysis passes, over one capstone handle.
+
+    A function is bounded by the next symbol and decoded on demand with
+    cs_disasm_iter, without detail. The decoded instructions are cached,
+    a pass that stops early leaves the rest undecoded and later passes
+    start from what is already there. Operands are decoded per
+    instruction with detail(), only for the instructions a pass inspects.
+
+    The AArch64 passes match raw instruction words with arm64_decode()
+    instead, capstone is only opened when a pass decodes through it.
+*/
+class Disassembler {
+    struct Function {
+        uintptr_t end { 0 };
+        bool invalid { false }; // stopped on undecodable bytes
+        std::vector<DisasmInsn> insns {};
+    };
+
+    KernelInformation& _ki;
+    cs_arch _arch;
+    cs_mode _mode;
+    bool _opened { false };
+    csh _handle {};
+    cs_insn* _plain { nullptr };
+    cs_insn* _detailed { nullptr };
+    std::unordered_map<uintptr_t, Function> _functions {};
+
+    void open();
+    uintptr_t end_of(uintptr_t symbol, size_t limit) const;
+    Function& function(uintptr_t symbol, size_t limit);
+    bool decode_next(Function& func, uintptr_t symbol);
+
+public:
+    Disassembler(KernelInformation& ki, cs_arch arch, cs_mode mode);
+
+    // for the architecture of the kernel
+    explicit Disassembler(KernelInformation& ki);
+
+    ~Disassembler();
+
+    Disassembler(const Disassembler&) = delete;
+    Disassembler& operator=(const Disassembler&) = delete;
+
+    cs_arch arch() const { return _arch; }
+
+    KernelArch kernel_arch() const { return _ki.arch; }
+
+    // visit the function at `symbol`, at most `limit` bytes, until `visit` returns true
+    template <typename F>
+    bool walk(uintptr_t symbol, size_t limit, F&& visit)
+    {
+        auto& func = function(symbol, limit);
+        for (size_t i = 0;; ++i) {
+            if (i == func.insns.size() and not decode_next(func, symbol)) {
+                return false;
+            }
+            auto insn = func.insns[i];
+            if (visit(insn)) {
+                return true;
+            }
+        }
+    }
+
+    // the whole function, at most `limit` bytes
+    const std::vector<DisasmInsn>& decode(uintptr_t symbol, size_t limit);
+
+    // `insn` with its operands, valid until the next call
+    const cs_insn& detail(const DisasmInsn& insn);
+
+    // the instruction words of the function at `symbol`, at most `limit` bytes, AArch64 only
+    std::basic_string_view<uint32_t> words(uintptr_t symbol, size_t limit) const;
+};
+
+/*
+    The analysis passes of one kernel architecture. The backend is picked
+    from the image at runtime, any host runs any of them. Passes an
+    architecture has no use for, or no implementation of, are nullptr.
+*/
+struct ArchBackend {
+    KernelArch arch;
+    const char* name;
+    cs_arch capstone_arch;
+    cs_mode capstone_mode;
+
+    std::tuple<uintptr_t, uintptr_t> (*module_layout)(Disassembler& disasm, uintptr_t sys_delete_module);
+    size_t (*kernel_symbol_size)(Disassembler& disasm, uintptr_t sym_module_get_kallsym);
+    uintptr_t (*mm_pgd_offset)(Disassembler& disasm, uintptr_t create_pgd_mapping);
+    void (*relocate_kernel)(KernelInformation& ki, Disassembler& disasm);
+};
+
+const ArchBackend& arch_backend(KernelArch arch);
+
+// from the image header, or the symbols for images without one. ki.kallsyms must be loaded
+KernelArch detect_kernel_arch(KernelInformation& ki);
+
+// the passes of the kernel's backend
+std::tuple<uintptr_t, uintptr_t> get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module);
+
+size_t get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym);
+
+// AArch64, native instruction decoding
+std::tuple<uintptr_t, uintptr_t> arm64_get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module);
+size_t arm64_get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym);
+
+// x86_64, through capstone
+std::tuple<uintptr_t, uintptr_t> x86_get_module_layout(Disassembler& disasm, uintptr_t sys_delete_module);
+size_t x86_get_kernel_symbol_size(Disassembler& disasm, uintptr_t sym_module_get_kallsym);
+
+struct Arm64Relocation {
+    uintptr_t rela_offset { 0 }; // relative to _head
+    uintptr_t rela_size { 0 };
+    uintptr_t relr_offset { 0 }; // relative to _head, CONFIG_RELR
+    uintptr_t relr_size { 0 };
+    uint64_t default_base { 0 }; // KIMAGE_VADDR
+};
+
+// the relocation tables, from __relocate_kernel or the linker symbols. The image is not touched
+Arm64Relocation arm64_get_relocation(KernelInformation& ki, Disassembler& disasm);
+
+// relocate `image` (starting at _head) by `kaslr`, as __relocate_kernel does
+void arm64_apply_relocation(uint8_t* image, size_t size, uintptr_t load_offset, const Arm64Relocation& reloc, uintptr_t kaslr);
+
+/*
+    Relocation applied on first access. The relocated words are bucketed
+    by page once, a page is patched the first time a range over it is
+    requested, the rest of the image is never written.
+*/
+class Arm64LazyRelocation {
+    static constexpr size_t page_size = 4096;
+
+    struct Entry {
+        uint32_t offset;
+        uint32_t rela; // RELA entry index, UINT32_MAX for RELR
+    };
+
+    uint8_t* _image;
+    const Elf64_Rela* _rela;
+    uintptr_t _kaslr;
+
+    std::vector<uint32_t> _pages {}; // first entry of each page, one past the last page
+    std::vector<Entry> _entries {};
+    std::vector<bool> _relocated {};
+
+public:
+    Arm64LazyRelocation(uint8_t* image, size_t size, uintptr_t load_offset, const Arm64Relocation& reloc, uintptr_t kaslr);
 
-size_t get_kernel_symbol_size(uint8_t* sym_module_get_kallsym);
+    void apply(size_t offset, size_t size);
+};
 
-bool arm64_decode_movn_movk(cs_insn* insn, size_t count, uint64_t* output);
-void arm64_relocate_kernel(KernelInformation& ki, uint8_t* __relocate_kernel);
-uintptr_t arm64_get_mm_pgd_offset(uint8_t* create_pgd_mapping);
+// installs a lazy relocation as ki.relocate
+void arm64_relocate_kernel(KernelInformation& ki, Disassembler& disasm);
+uintptr_t arm64_get_mm_pgd_offset(Disassembler& disasm, uintptr_t create_pgd_mapping);
 
 #endif
@@ -1,3 +1,9 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
 #include <tuple>
 
 #include "unicorn/unicorn.h"
@@ -6,6 +12,8 @@
 #include <boost/log/trivial.hpp>
 
 #include "kdeploy.h"
+#include "disasm.h"
+#include "find_symbol_crc_unicorn.h"
 
 using namespace std::string_literals;
 
@@ -61,118 +69,246 @@ void dump_uc(cs_arch arch, cs_mode mode, uc_engine* uc)
     cs_close(&handle);
 }
 
-std::tuple<bool, unsigned long> find_symbol_crc_unicorn(KernelInformation& ki, const std::string& name)
+constexpr uintptr_t stack_base = 0x200000;
+constexpr uintptr_t stack_size = 0x100000;
+constexpr uintptr_t stack_ptr = stack_base + stack_size - 0x1000;
+
+// arguments are placed at the bottom of the stack mapping
+constexpr uintptr_t name_ptr = stack_base;
+constexpr size_t name_size = 0x800;
+constexpr uintptr_t args_ptr = stack_base + name_size;
+
+// functions return here, which ends the emulation
+constexpr uintptr_t stop_addr = 1;
+
+static uc_engine* open_engine(void* image, uintptr_t head, size_t size)
 {
-    uc_engine *uc{nullptr};
+    uc_engine* uc { nullptr };
     auto err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
-
     if (err != UC_ERR_OK) {
         throw std::runtime_error("Unable to open unicorn engine "s + std::to_string(err));
     }
 
-    auto head = ki.find_symbol("_head");
-    auto end = ki.find_symbol("_end");
-    uintptr_t kaslr = head - ki.load_offset - ki.default_base;
-
-    err = uc_mem_map_ptr(uc, head, ki.buffer.capacity(), UC_PROT_READ | UC_PROT_WRITE | UC_PROT_EXEC, ki.buffer.data());
+    err = uc_mem_map_ptr(uc, head, size, UC_PROT_READ | UC_PROT_WRITE | UC_PROT_EXEC, image);
     if (err != UC_ERR_OK) {
+        uc_close(uc);
         throw std::runtime_error("Unable to map kernel image "s + std::to_string(err));
     }
 
-    uintptr_t stack_base = 0x200000;
-    uintptr_t stack_size = 0x100000;
-    uintptr_t stack_ptr = stack_base + stack_size - 0x1000;
-
     err = uc_mem_map(uc, stack_base, stack_size, UC_PROT_READ | UC_PROT_WRITE);
     if (err != UC_ERR_OK) {
+        uc_close(uc);
         throw std::runtime_error("Unable to map stack memory "s + std::to_string(err));
     }
 
-    {
-        uintptr_t stop_addr = 1;
-
-        uc_reg_write(uc, UC_ARM64_REG_SP, &stack_ptr);
-        uc_reg_write(uc, UC_ARM64_REG_LR, &stop_addr);
-
-        uc_reg_write(uc, UC_ARM64_REG_X23, &kaslr);
-
-        err = uc_emu_start(uc, ki.get_symbol("__relocate_kernel"), stop_addr, 0, 0);
-        if (err != UC_ERR_OK) {
-            uintptr_t pc{0};
-            uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
-            if (pc != 1) {
-                BOOST_LOG_TRIVIAL(debug) << "head " << (void*)head;
-                BOOST_LOG_TRIVIAL(debug) << "end  " << (void*)end;
-                dump_uc(CS_ARCH_ARM64, CS_MODE_ARM, uc);
-                throw std::runtime_error("uc_emu_start error __relocate_kernel "s + std::to_string(err));
-            }
+    return uc;
+}
+
+static void call(uc_engine* uc, uintptr_t function, const char* name)
+{
+    uintptr_t sp = stack_ptr;
+    uintptr_t lr = stop_addr;
+
+    uc_reg_write(uc, UC_ARM64_REG_SP, &sp);
+    uc_reg_write(uc, UC_ARM64_REG_LR, &lr);
+
+    auto err = uc_emu_start(uc, function, stop_addr, 0, 0);
+    if (err != UC_ERR_OK) {
+        uintptr_t pc { 0 };
+        uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+        if (pc != stop_addr) {
+            dump_uc(CS_ARCH_ARM64, CS_MODE_ARM, uc);
+            throw std::runtime_error("uc_emu_start error "s + name + " " + std::to_string(err));
         }
     }
+}
 
-    {
-        uintptr_t owner_ptr_ptr = stack_base;
-        uintptr_t crc_ptr_ptr = stack_base + 8;
-        uintptr_t name_ptr = stack_base + 16;
-        uintptr_t stop_addr = 1;
+UnicornSnapshot::UnicornSnapshot(KernelInformation& ki, Disassembler& disasm)
+{
+    _head = ki.find_symbol("_head", ki.sym_text);
+    auto end = ki.get_symbol("_end");
+    if (end <= ki.sym_text or ki.sym_text < _head) {
+        throw std::runtime_error("invalid kernel image range");
+    }
+
+    // image and bss
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    _size = (end - _head + page_size - 1) / page_size * page_size;
+
+    char* image { nullptr };
+
+    _fd = create_memfd("kdeploy-snapshot");
+    if (_fd) {
+        if (ftruncate(_fd.get(), _size) == -1) {
+            throw std::runtime_error("ftruncate failed "s + strerror(errno));
+        }
+
+        image = static_cast<char*>(mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd.get(), 0));
+        if (image == MAP_FAILED) {
+            throw std::runtime_error("Unable to map snapshot "s + strerror(errno));
+        }
+    } else {
+        BOOST_LOG_TRIVIAL(debug) << "memfd_create: " << strerror(errno) << ", sessions copy the snapshot";
+        _image.resize(_size);
+        image = _image.data();
+    }
+
+    auto unmap = ScopeTail([&]() {
+        if (_fd) {
+            munmap(image, _size);
+        }
+    });
+
+    size_t text_offset = ki.sym_text - _head;
+    memcpy(image + text_offset, ki.buffer.data(), std::min(ki.buffer.size(), _size - text_offset));
+
+    auto reloc = arm64_get_relocation(ki, disasm);
+
+    // the image is placed at its runtime address
+    uintptr_t kaslr = ki.sym_text - ki.load_offset - reloc.default_base;
+
+    BOOST_LOG_TRIVIAL(debug) << "snapshot head " << (void*)_head << " size " << (void*)_size << " kaslr " << (void*)kaslr;
+
+    arm64_apply_relocation(reinterpret_cast<uint8_t*>(image + text_offset), _size - text_offset, ki.load_offset, reloc, kaslr);
+
+    uintptr_t kimage_vaddr { 0 };
+    memcpy(&kimage_vaddr, image + (ki.get_symbol("kimage_vaddr") - _head), sizeof(kimage_vaddr));
+
+    _crc_offset = kimage_vaddr - reloc.default_base;
+    _find_symbol = ki.get_symbol("find_symbol");
+    _find_symbol_arg = not ki.version_old_then(5, 12, 0);
+    _crc32 = not ki.version_old_then(4, 11, 0);
+}
+
+UnicornSession::UnicornSession(const UnicornSnapshot& snapshot)
+    : _snapshot(snapshot)
+{
+    if (snapshot._fd) {
+        _image = ImageBuffer::map(snapshot._fd.get(), snapshot._size);
+    } else {
+        _image.resize(snapshot._size);
+        memcpy(_image.data(), snapshot._image.data(), snapshot._size);
+    }
+
+    _uc = open_engine(_image.data(), snapshot._head, snapshot._size);
+
+    auto err = uc_context_alloc(_uc, &_context);
+    if (err != UC_ERR_OK) {
+        uc_close(_uc);
+        throw std::runtime_error("Unable to allocate unicorn context "s + std::to_string(err));
+    }
+
+    uc_context_save(_uc, _context);
+}
+
+UnicornSession::~UnicornSession()
+{
+    uc_context_free(_context);
+    uc_close(_uc);
+}
+
+std::tuple<bool, unsigned long> UnicornSession::find_symbol_crc(std::string_view name)
+{
+    if (name.size() >= name_size) {
+        return { false, 0 };
+    }
+
+    uc_context_restore(_uc, _context);
+    uc_mem_write(_uc, name_ptr, name.data(), name.size());
+    uc_mem_write(_uc, name_ptr + name.size(), "", 1);
+
+    uintptr_t result { 0 };
+    uintptr_t crc_ptr { 0 };
+
+    if (_snapshot._find_symbol_arg) {
+        /*
+            struct find_symbol_arg {
+                const char *name;
+                bool gplok;
+                bool warn;
+                struct module *owner;
+                const s32 *crc;
+                const struct kernel_symbol *sym;
+                enum mod_license license;
+            };
+        */
+        uint64_t fsa[6] {};
+        fsa[0] = name_ptr;
+        fsa[1] = 1; // gplok
+
+        uintptr_t arg = args_ptr;
+        uc_mem_write(_uc, args_ptr, fsa, sizeof(fsa));
+        uc_reg_write(_uc, UC_ARM64_REG_X0, &arg);
+
+        call(_uc, _snapshot._find_symbol, "find_symbol");
+
+        // bool
+        uc_reg_read(_uc, UC_ARM64_REG_X0, &result);
+        result &= 0xff;
+
+        uc_mem_read(_uc, args_ptr + 24, &crc_ptr, sizeof(crc_ptr));
+
+    } else {
+        // find_symbol(name, &owner, &crc, gplok, warn)
+        uintptr_t owner_ptr_ptr = args_ptr;
+        uintptr_t crc_ptr_ptr = args_ptr + 8;
         uintptr_t gpl_ok = 1;
         uintptr_t warn = 0;
-        uintptr_t result = 0;
-
-        uc_mem_write(uc, name_ptr, name.c_str(), name.size() + 1);
-
-        uc_reg_write(uc, UC_ARM64_REG_SP, &stack_ptr);
-        uc_reg_write(uc, UC_ARM64_REG_LR, &stop_addr);
-
-        uc_reg_write(uc, UC_ARM64_REG_X0, &name_ptr);
-        uc_reg_write(uc, UC_ARM64_REG_X1, &owner_ptr_ptr);
-        uc_reg_write(uc, UC_ARM64_REG_X2, &crc_ptr_ptr);
-        uc_reg_write(uc, UC_ARM64_REG_X3, &gpl_ok);
-        uc_reg_write(uc, UC_ARM64_REG_X4, &warn);
-
-        err = uc_emu_start(uc, ki.get_symbol("find_symbol"), stop_addr, 0, 0);
-        if (err != UC_ERR_OK) {
-            uintptr_t pc{0};
-            uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
-            if (pc != 1) {
-                BOOST_LOG_TRIVIAL(debug) << "head " << (void*)head;
-                BOOST_LOG_TRIVIAL(debug) << "end  " << (void*)end;
-                dump_uc(CS_ARCH_ARM64, CS_MODE_ARM, uc);
-                throw std::runtime_error("uc_emu_start error find_symbol "s + std::to_string(err));
-            }
-        }
+        uint64_t out[2] {};
 
-        uc_reg_read(uc, UC_ARM64_REG_X0, &result);
-        if (result != 0) {
-            uintptr_t kimage_vaddr{0};
-            uc_mem_read(uc, ki.get_symbol("kimage_vaddr"), &kimage_vaddr, 8);
-            auto reloc_start = kimage_vaddr - ki.default_base;
-            // BOOST_LOG_TRIVIAL(debug) << "reloc_start  " << (void*)(kimage_vaddr - ki.default_base);
-            
-            // BOOST_LOG_TRIVIAL(debug) << "result  " << (void*)result;
-            // uintptr_t name_ptr{0};
-            // uc_mem_read(uc, result + 8, &name_ptr, 8);
+        uintptr_t name_arg = name_ptr;
+        uc_mem_write(_uc, args_ptr, out, sizeof(out));
+        uc_reg_write(_uc, UC_ARM64_REG_X0, &name_arg);
+        uc_reg_write(_uc, UC_ARM64_REG_X1, &owner_ptr_ptr);
+        uc_reg_write(_uc, UC_ARM64_REG_X2, &crc_ptr_ptr);
+        uc_reg_write(_uc, UC_ARM64_REG_X3, &gpl_ok);
+        uc_reg_write(_uc, UC_ARM64_REG_X4, &warn);
 
-            // std::string name_buf{};
-            // name_buf.resize(32);
-            // uc_mem_read(uc, name_ptr, name_buf.data(), 32);
+        call(_uc, _snapshot._find_symbol, "find_symbol");
 
-            // BOOST_LOG_TRIVIAL(debug) << "s  " << name_buf;
+        // const struct kernel_symbol *
+        uc_reg_read(_uc, UC_ARM64_REG_X0, &result);
+
+        uc_mem_read(_uc, crc_ptr_ptr, &crc_ptr, sizeof(crc_ptr));
+    }
+
+    // not exported, or exported without crc
+    if (result == 0 or crc_ptr == 0) {
+        return { false, 0 };
+    }
 
-            uintptr_t owner_ptr{0};
-            uintptr_t crc_ptr{0};
-            uintptr_t crc{0};
+    if (_snapshot._crc32) {
+        uint32_t crc { 0 };
+        uc_mem_read(_uc, crc_ptr, &crc, sizeof(crc));
+        return { true, crc };
+    }
 
-            uc_mem_read(uc, owner_ptr_ptr, &owner_ptr, 8);
-            uc_mem_read(uc, crc_ptr_ptr, &crc_ptr, 8);
-            uc_mem_read(uc, crc_ptr, &crc, 8);
+    // the crcs were relocated along with the image
+    uint64_t crc { 0 };
+    uc_mem_read(_uc, crc_ptr, &crc, sizeof(crc));
+    return { true, crc - _snapshot._crc_offset };
+}
 
-            // BOOST_LOG_TRIVIAL(debug) << "reloc_start  " << (void*)reloc_start;
-            // BOOST_LOG_TRIVIAL(debug) << "crc_ptr  " << (void*)crc_ptr;
-            // BOOST_LOG_TRIVIAL(debug) << "crc  " << (void*)(crc);
+UnicornPool::UnicornPool(KernelInformation& ki, Disassembler& disasm)
+    : _snapshot(ki, disasm)
+{
+}
 
-            return { true, crc - reloc_start };
+std::unique_ptr<UnicornSession> UnicornPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock { _mutex };
+        if (not _idle.empty()) {
+            auto session = std::move(_idle.back());
+            _idle.pop_back();
+            return session;
         }
     }
+    return std::make_unique<UnicornSession>(_snapshot);
+}
 
-    return { false, 0 };
+void UnicornPool::release(std::unique_ptr<UnicornSession> session)
+{
+    std::lock_guard<std::mutex> lock { _mutex };
+    _idle.push_back(std::move(session));
 }
@@ -0,0 +1,88 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __find_symbol_crc_unicorn_h__
+#define __find_symbol_crc_unicorn_h__
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "unicorn/unicorn.h"
+
+#include "buffer.h"
+#include "disasm.h"
+#include "kdeploy.h"
+#include "utils.h"
+
+/*
+    The kernel image relocated to its runtime address, kept in a memfd.
+    Without memfd, before 3.17, it is kept in anonymous memory and every
+    session copies it. Create it before the image buffer is relocated
+    statically.
+*/
+class UnicornSnapshot {
+    UniqueFD _fd {};
+    ImageBuffer _image {}; // only without memfd
+    uintptr_t _head { 0 };
+    size_t _size { 0 };
+
+    uintptr_t _find_symbol { 0 };
+    uintptr_t _crc_offset { 0 }; // subtracted from relocated crcs before 4.11
+    bool _find_symbol_arg { false }; // find_symbol(struct find_symbol_arg*) since 5.12
+    bool _crc32 { false };
+
+    friend class UnicornSession;
+
+public:
+    UnicornSnapshot(KernelInformation& ki, Disassembler& disasm);
+};
+
+// one engine over a private copy of the snapshot
+class UnicornSession {
+    const UnicornSnapshot& _snapshot;
+    ImageBuffer _image {};
+    uc_engine* _uc { nullptr };
+    uc_context* _context { nullptr };
+
+public:
+    explicit UnicornSession(const UnicornSnapshot& snapshot);
+    ~UnicornSession();
+
+    UnicornSession(const UnicornSession&) = delete;
+    UnicornSession& operator=(const UnicornSession&) = delete;
+
+    // call the kernel's find_symbol
+    std::tuple<bool, unsigned long> find_symbol_crc(std::string_view name);
+};
+
+// sessions are created on demand and reused, one per concurrent caller
+class UnicornPool {
+    UnicornSnapshot _snapshot;
+    std::mutex _mutex {};
+    std::vector<std::unique_ptr<UnicornSession>> _idle {};
+
+public:
+    UnicornPool(KernelInformation& ki, Disassembler& disasm);
+
+    std::unique_ptr<UnicornSession> acquire();
+    void release(std::unique_ptr<UnicornSession> session);
+};
+
+#endif
@@ -0,0 +1,805 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <numeric>
+
+#include <boost/log/trivial.hpp>
+
+#include "kallsyms.h"
+#include "utils.h"
+
+constexpr size_t initial_arena_size = 4 * 1024 * 1024;
+constexpr size_t min_table_size = 16;
+constexpr size_t stream_chunk_size = 256 * 1024;
+
+static bool is_space(char c)
+{
+    return c == ' ' or c == '\t' or c == '\n' or c == '\r';
+}
+
+// "%lx %c %s" optionally followed by "\t[module]"
+static bool parse_line(const char* iter, const char* eol, uintptr_t& address, char& type, std::string_view& name)
+{
+    auto [ptr, ec] = std::from_chars(iter, eol, address, 16);
+    if (ec != std::errc {} or eol - ptr < 4 or ptr[0] != ' ' or ptr[2] != ' ') {
+        return false;
+    }
+
+    type = ptr[1];
+
+    auto* begin = ptr + 3;
+    auto* end = begin;
+    while (end < eol and not is_space(*end)) {
+        ++end;
+    }
+
+    name = { begin, static_cast<size_t>(end - begin) };
+    return not name.empty() and name.size() <= UINT16_MAX;
+}
+
+void SymbolRequest::require(std::string_view name)
+{
+    _late.erase(name);
+
+    auto [iter, inserted] = _names.emplace(name, true);
+    if (inserted) {
+        ++_required;
+    } else if (not iter->second) {
+        iter->second = true;
+        ++_required;
+    }
+}
+
+void SymbolRequest::want(std::string_view name)
+{
+    _names.emplace(name, false);
+}
+
+void SymbolRequest::want_late(std::string_view name)
+{
+    auto iter = _names.find(name);
+    if (iter == _names.end() or not iter->second) {
+        _names.emplace(name, false);
+        _late.insert(name);
+    }
+}
+
+void SymbolRequest::fence(std::string_view name)
+{
+    want(name);
+    _fence = name;
+}
+
+const bool* SymbolRequest::find(std::string_view name) const
+{
+    auto iter = _names.find(name);
+    if (iter == _names.end()) {
+        return nullptr;
+    }
+    return &iter->second;
+}
+
+bool SymbolIndex::load(const std::string& filename, const SymbolRequest* request)
+{
+    UniqueFD fd { ::open(filename.c_str(), O_RDONLY) };
+    if (not fd) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to opend file " << filename << " " << strerror(errno);
+        return false;
+    }
+
+    if (request != nullptr) {
+        if (not load_requested(fd.get(), *request)) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to read file " << filename << " " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    // procfs files have no size, read in large blocks until EOF
+    size_t size = 0;
+    while (true) {
+        // one spare byte for the NUL of the last name
+        if (_arena.capacity() - size < 2) {
+            _arena.reserve(std::max(initial_arena_size, _arena.capacity() * 2));
+        }
+
+        auto sz = ::read(fd.get(), _arena.data() + size, _arena.capacity() - size - 1);
+        if (sz == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            BOOST_LOG_TRIVIAL(error) << "Failed to read file " << filename << " " << strerror(errno);
+            return false;
+        }
+        if (sz == 0) {
+            break;
+        }
+        size += sz;
+    }
+
+    parse(size);
+    return true;
+}
+
+void SymbolIndex::parse(size_t size)
+{
+    char* arena = _arena.data();
+    const char* iter = arena;
+    const char* end = arena + size;
+
+    // names are compacted to the front of the buffer as they are parsed,
+    // the write position never passes the read position
+    size_t output = 0;
+
+    _symbols.clear();
+    _symbols.reserve(size / 40);
+
+    while (iter < end) {
+        auto* eol = static_cast<const char*>(memchr(iter, '\n', end - iter));
+        if (eol == nullptr) {
+            eol = end;
+        }
+
+        uintptr_t address { 0 };
+        char type { 0 };
+        std::string_view name {};
+        if (parse_line(iter, eol, address, type, name)) {
+            memmove(arena + output, name.data(), name.size());
+            arena[output + name.size()] = '\0';
+            _symbols.push_back(Symbol { address, static_cast<uint32_t>(output), static_cast<uint16_t>(name.size()), type });
+            output += name.size() + 1;
+        }
+
+        iter = eol + 1;
+    }
+
+    _arena.resize(output);
+    _arena.shrink_to_fit();
+
+    _by_address.clear();
+    _by_name.clear();
+
+    size_t capacity = min_table_size;
+    while (capacity < _symbols.size() * 2) {
+        capacity *= 2;
+    }
+    rehash(capacity);
+}
+
+bool SymbolIndex::load_requested(int fd, const SymbolRequest& request)
+{
+    std::unique_ptr<char[]> buffer { new char[stream_chunk_size] };
+    size_t pending = 0;
+
+    size_t required = 0;
+    size_t late = 0;
+    bool fence_passed = request.fence().empty();
+
+    auto done = [&]() {
+        return size() == request.size() or (required == request.required() and late == request.late() and fence_passed);
+    };
+
+    while (not done()) {
+        auto sz = ::read(fd, buffer.get() + pending, stream_chunk_size - pending);
+        if (sz == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        bool eof = sz == 0;
+        pending += sz;
+
+        const char* iter = buffer.get();
+        const char* end = iter + pending;
+
+        while (iter < end and not done()) {
+            auto* eol = static_cast<const char*>(memchr(iter, '\n', end - iter));
+            if (eol == nullptr) {
+                if (not eof) {
+                    break;
+                }
+                eol = end;
+            }
+
+            uintptr_t address { 0 };
+            char type { 0 };
+            std::string_view name {};
+            if (parse_line(iter, eol, address, type, name)) {
+                auto* is_required = request.find(name);
+                if (is_required != nullptr and find(name) == nullptr) {
+                    add(name, address, type);
+                    if (*is_required) {
+                        ++required;
+                    } else if (request.late(name)) {
+                        ++late;
+                    }
+                }
+                if (name == request.fence()) {
+                    fence_passed = true;
+                }
+            }
+
+            iter = eol + 1;
+        }
+
+        if (eof) {
+            break;
+        }
+
+        // keep the partial line
+        pending = end > iter ? end - iter : 0;
+        memmove(buffer.get(), iter, pending);
+
+        if (pending == stream_chunk_size) {
+            // no line is that long
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SymbolIndex::append_name(std::string_view name, Symbol& symbol)
+{
+    auto size = _arena.size();
+    if (_arena.capacity() < size + name.size() + 1) {
+        _arena.reserve(std::max({ initial_arena_size, _arena.capacity() * 2, size + name.size() + 1 }));
+    }
+    _arena.resize(size + name.size() + 1);
+
+    memcpy(_arena.data() + size, name.data(), name.size());
+    _arena.data()[size + name.size()] = '\0';
+
+    symbol.name = static_cast<uint32_t>(size);
+    symbol.size = static_cast<uint16_t>(name.size());
+}
+
+void SymbolIndex::add(std::string_view name, uintptr_t address, char type)
+{
+    if (name.empty() or name.size() > UINT16_MAX) {
+        return;
+    }
+
+    Symbol symbol { address, 0, 0, type };
+    append_name(name, symbol);
+    _symbols.push_back(symbol);
+
+    _by_address.clear();
+    _by_name.clear();
+
+    if (_symbols.size() * 2 > _table.size()) {
+        rehash(std::max(min_table_size, _table.size() * 2));
+    } else {
+        insert(static_cast<uint32_t>(_symbols.size() - 1));
+    }
+}
+
+void SymbolIndex::reserve(size_t count, size_t names)
+{
+    _symbols.reserve(count);
+
+    if (_arena.capacity() < _arena.size() + names) {
+        _arena.reserve(_arena.size() + names);
+    }
+
+    size_t capacity = std::max(min_table_size, _table.size());
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    if (capacity != _table.size()) {
+        rehash(capacity);
+    }
+}
+
+void SymbolIndex::insert(uint32_t index)
+{
+    auto name = name_of(_symbols[index]);
+    size_t mask = _table.size() - 1;
+    size_t slot = std::hash<std::string_view> {}(name) & mask;
+
+    while (_table[slot] != 0) {
+        // keep the first symbol of a name
+        if (name_of(_symbols[_table[slot] - 1]) == name) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    _table[slot] = index + 1;
+}
+
+void SymbolIndex::rehash(size_t capacity)
+{
+    _table.assign(capacity, 0);
+    for (uint32_t i = 0; i < _symbols.size(); ++i) {
+        insert(i);
+    }
+}
+
+const Symbol* SymbolIndex::find(std::string_view name) const
+{
+    if (_table.empty()) {
+        return nullptr;
+    }
+
+    size_t mask = _table.size() - 1;
+    size_t slot = std::hash<std::string_view> {}(name) & mask;
+
+    while (_table[slot] != 0) {
+        auto& symbol = _symbols[_table[slot] - 1];
+        if (name_of(symbol) == name) {
+            return &symbol;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return nullptr;
+}
+
+const std::vector<uint32_t>& SymbolIndex::by_address() const
+{
+    if (_by_address.size() != _symbols.size()) {
+        _by_address.resize(_symbols.size());
+        std::iota(_by_address.begin(), _by_address.end(), 0);
+        std::stable_sort(_by_address.begin(), _by_address.end(), [this](uint32_t a, uint32_t b) {
+            return _symbols[a].address < _symbols[b].address;
+        });
+    }
+    return _by_address;
+}
+
+const std::vector<uint32_t>& SymbolIndex::by_name() const
+{
+    if (_by_name.size() != _symbols.size()) {
+        _by_name.resize(_symbols.size());
+        std::iota(_by_name.begin(), _by_name.end(), 0);
+        std::stable_sort(_by_name.begin(), _by_name.end(), [this](uint32_t a, uint32_t b) {
+            return name_of(_symbols[a]) < name_of(_symbols[b]);
+        });
+    }
+    return _by_name;
+}
+
+uintptr_t SymbolIndex::next_address(uintptr_t address) const
+{
+    auto& view = by_address();
+    auto iter = std::upper_bound(view.begin(), view.end(), address, [this](uintptr_t addr, uint32_t index) {
+        return addr < _symbols[index].address;
+    });
+    if (iter == view.end()) {
+        return 0;
+    }
+    return _symbols[*iter].address;
+}
+
+// embedded kallsyms
+
+constexpr size_t kallsyms_max_scan = 64 * 1024 * 1024;
+constexpr uint32_t kallsyms_min_syms = 256;
+constexpr uint32_t kallsyms_max_syms = 4 * 1024 * 1024;
+constexpr size_t kallsyms_probe_names = 32;
+
+namespace {
+
+struct TokenTable {
+    std::array<std::string_view, 256> tokens {};
+};
+
+// KSYM_NAME_LEN is 512 since 6.1
+struct ExpandedName {
+    char data[1024];
+    size_t size;
+};
+
+}
+
+template <typename T>
+static T read_as(std::string_view image, size_t offset)
+{
+    T value {};
+    memcpy(&value, image.data() + offset, sizeof(T));
+    return value;
+}
+
+static size_t align_up(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static bool is_symbol_type(char c)
+{
+    return strchr("aAbBdDgGiInNrRsStTuUvVwW?", c) != nullptr and c != '\0';
+}
+
+// position of the name after the one at `pos`, 0 if it runs past the image
+static size_t skip_name(std::string_view image, size_t pos, size_t* tokens = nullptr)
+{
+    if (pos + 2 > image.size()) {
+        return 0;
+    }
+
+    // names longer than 127 tokens have a two byte length since 6.1
+    size_t length = static_cast<uint8_t>(image[pos++]);
+    if ((length & 0x80) != 0) {
+        length = (length & 0x7f) | (static_cast<size_t>(static_cast<uint8_t>(image[pos++])) << 7);
+    }
+
+    if (length == 0 or pos + length > image.size()) {
+        return 0;
+    }
+
+    if (tokens != nullptr) {
+        *tokens = pos;
+    }
+    return pos + length;
+}
+
+/*
+    Expand the name at `pos` into `name`, the type char first.
+    Returns the position of the next name, 0 if the name is malformed.
+*/
+static size_t expand_name(std::string_view image, size_t pos, const TokenTable& table, ExpandedName& name)
+{
+    size_t tokens = 0;
+    size_t next = skip_name(image, pos, &tokens);
+    if (next == 0) {
+        return 0;
+    }
+
+    size_t size = 0;
+    for (size_t i = tokens; i < next; ++i) {
+        auto token = table.tokens[static_cast<uint8_t>(image[i])];
+        if (size + token.size() > sizeof(name.data)) {
+            return 0;
+        }
+        memcpy(name.data + size, token.data(), token.size());
+        size += token.size();
+    }
+
+    if (size < 2) {
+        return 0;
+    }
+
+    name.size = size;
+    return next;
+}
+
+static bool is_valid_name(const ExpandedName& name)
+{
+    if (not is_symbol_type(name.data[0])) {
+        return false;
+    }
+
+    for (size_t i = 1; i < name.size; ++i) {
+        if (name.data[i] <= ' ' or name.data[i] > '~') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool load_token_table(std::string_view image, size_t token_table, size_t token_index, TokenTable& table)
+{
+    for (size_t i = 0; i < 256; ++i) {
+        size_t begin = token_table + read_as<uint16_t>(image, token_index + i * 2);
+        auto* end = static_cast<const char*>(memchr(image.data() + begin, '\0', token_index - begin));
+        if (end == nullptr) {
+            return false;
+        }
+        table.tokens[i] = { image.data() + begin, static_cast<size_t>(end - (image.data() + begin)) };
+    }
+    return true;
+}
+
+/*
+    Every digit appears in some symbol, tokens '0'...'9' are the digits
+    themselves. Walk forward from '0' to the end of the token table, the
+    token index follows and tells where '0' is relative to the table start.
+*/
+static bool find_token_table(std::string_view image, size_t digits, KallsymsTables& tables)
+{
+    if (digits == 0 or image[digits - 1] != '\0') {
+        return false;
+    }
+
+    size_t end = digits;
+    for (int i = '0'; i < 256; ++i) {
+        auto* nul = static_cast<const char*>(memchr(image.data() + end, '\0', std::min<size_t>(image.size() - end, 256)));
+        if (nul == nullptr or nul == image.data() + end) {
+            return false;
+        }
+        end = nul - image.data() + 1;
+    }
+
+    for (size_t align : { 8, 4 }) {
+        size_t index = align_up(end, align);
+        if (index + 512 > image.size()) {
+            continue;
+        }
+
+        size_t zero_offset = read_as<uint16_t>(image, index + '0' * 2);
+        if (read_as<uint16_t>(image, index) != 0 or zero_offset > digits) {
+            continue;
+        }
+
+        size_t table = digits - zero_offset;
+        bool valid = true;
+        uint16_t previous = 0;
+        for (size_t i = 1; i < 256 and valid; ++i) {
+            auto offset = read_as<uint16_t>(image, index + i * 2);
+            valid = offset > previous and table + offset < end and image[table + offset - 1] == '\0';
+            previous = offset;
+        }
+
+        if (valid) {
+            tables.token_table = table;
+            tables.token_index = index;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Walk back from `highest` to a kallsyms_num_syms in [min_count, max_count]
+    whose names decode and are followed by kallsyms_markers.
+*/
+static bool find_names(std::string_view image, const TokenTable& table, KallsymsTables& tables,
+    size_t lowest, size_t highest, uint32_t min_count, uint32_t max_count)
+{
+    ExpandedName name {};
+
+    for (size_t pos = highest & ~size_t { 3 }; pos >= lowest + 4;) {
+        pos -= 4;
+
+        auto count = read_as<uint32_t>(image, pos);
+        if (count < min_count or count > max_count) {
+            continue;
+        }
+
+        for (size_t names : { pos + 4, align_up(pos + 4, 8) }) {
+            if (names == pos + 8 and read_as<uint32_t>(image, pos + 4) != 0) {
+                continue;
+            }
+
+            // cheap probe before decoding all names
+            size_t iter = names;
+            for (size_t i = 0; i < kallsyms_probe_names and iter != 0; ++i) {
+                iter = expand_name(image, iter, table, name);
+                if (iter != 0 and not is_valid_name(name)) {
+                    iter = 0;
+                }
+            }
+            if (iter == 0) {
+                continue;
+            }
+
+            iter = names;
+            size_t second_marker = 0;
+            for (uint32_t i = 0; i < count and iter != 0 and iter < tables.token_table; ++i) {
+                if (i == 256) {
+                    second_marker = iter - names;
+                }
+                iter = skip_name(image, iter);
+            }
+            if (iter == 0 or iter >= tables.token_table) {
+                continue;
+            }
+
+            // markers are u32 since 4.20, unsigned long before
+            for (size_t markers : { align_up(iter, 4), align_up(iter, 8) }) {
+                for (size_t entry_size : { 4, 8 }) {
+                    if (markers + 2 * entry_size > tables.token_table) {
+                        continue;
+                    }
+                    if (read_as<uint32_t>(image, markers) != 0
+                        or (count > 256 and read_as<uint32_t>(image, markers + entry_size) != second_marker)) {
+                        continue;
+                    }
+
+                    tables.num_syms = pos;
+                    tables.names = names;
+                    tables.markers = markers;
+                    tables.count = count;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/*
+    Except for 6.2 and 6.3, kallsyms_markers ends right before the token
+    table. The last marker bounds the number of symbols and where the
+    names start, num_syms is searched near there only.
+*/
+static bool find_names_by_markers(std::string_view image, const TokenTable& table, KallsymsTables& tables)
+{
+    for (size_t end = tables.token_table; end + 16 > tables.token_table and end >= 8; end -= 4) {
+        for (size_t entry_size : { 4, 8 }) {
+            size_t pos = end;
+            size_t markers = 0;
+            uint32_t last_marker = 0;
+            uint32_t previous = UINT32_MAX;
+
+            while (pos >= entry_size) {
+                pos -= entry_size;
+                if (entry_size == 8 and read_as<uint32_t>(image, pos + 4) != 0) {
+                    break;
+                }
+
+                auto value = read_as<uint32_t>(image, pos);
+                if (value >= previous) {
+                    break;
+                }
+                if (markers == 0) {
+                    last_marker = value;
+                }
+                ++markers;
+                previous = value;
+
+                if (value == 0) {
+                    break;
+                }
+            }
+
+            if (previous != 0 or markers < 2) {
+                continue;
+            }
+
+            // num_syms precedes the name of symbol (markers - 1) * 256 by more than last_marker bytes
+            if (pos < last_marker + 8) {
+                continue;
+            }
+            size_t highest = pos - last_marker;
+            size_t lowest = highest > 64 * 1024 ? highest - 64 * 1024 : 0;
+            auto min_count = static_cast<uint32_t>((markers - 1) * 256 + 1);
+            auto max_count = static_cast<uint32_t>(markers * 256);
+
+            if (find_names(image, table, tables, lowest, highest, min_count, max_count)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool sorted_offsets(std::string_view image, size_t offsets, uint32_t count)
+{
+    if (offsets + static_cast<size_t>(count) * 4 + 8 > image.size()) {
+        return false;
+    }
+
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        auto offset = read_as<uint32_t>(image, offsets + i * 4);
+        if (offset < previous) {
+            return false;
+        }
+        previous = offset;
+    }
+    return true;
+}
+
+static bool find_offsets(std::string_view image, KallsymsTables& tables)
+{
+    // 6.4 and later, after the token index
+    size_t offsets = align_up(tables.token_index + 512, 8);
+    if (sorted_offsets(image, offsets, tables.count)) {
+        tables.offsets = offsets;
+        tables.relative_base = align_up(offsets + tables.count * 4, 8);
+        return true;
+    }
+
+    // before, ahead of num_syms
+    if (tables.num_syms < 8 + static_cast<size_t>(tables.count) * 4) {
+        return false;
+    }
+
+    size_t relative_base = (tables.num_syms - 8) & ~size_t { 7 };
+    offsets = (relative_base - tables.count * 4) & ~size_t { 7 };
+    if (sorted_offsets(image, offsets, tables.count)) {
+        tables.offsets = offsets;
+        tables.relative_base = relative_base;
+        return true;
+    }
+    return false;
+}
+
+bool find_kallsyms_tables(std::string_view image, KallsymsTables& tables)
+{
+    static const char digits[] = "0\0"
+                                 "1\0"
+                                 "2\0"
+                                 "3\0"
+                                 "4\0"
+                                 "5\0"
+                                 "6\0"
+                                 "7\0"
+                                 "8\0"
+                                 "9";
+
+    size_t pos = 0;
+    while (pos < image.size()) {
+        auto* hit = static_cast<const char*>(memmem(image.data() + pos, image.size() - pos, digits, sizeof(digits)));
+        if (hit == nullptr) {
+            break;
+        }
+        pos = hit - image.data() + 1;
+
+        KallsymsTables candidate {};
+        TokenTable table {};
+        if (not find_token_table(image, hit - image.data(), candidate)
+            or not load_token_table(image, candidate.token_table, candidate.token_index, table)) {
+            continue;
+        }
+
+        size_t lowest = candidate.token_table > kallsyms_max_scan ? candidate.token_table - kallsyms_max_scan : 0;
+        if (not find_names_by_markers(image, table, candidate)
+            and not find_names(image, table, candidate, lowest, candidate.token_table, kallsyms_min_syms, kallsyms_max_syms)) {
+            continue;
+        }
+
+        if (not find_offsets(image, candidate)) {
+            BOOST_LOG_TRIVIAL(debug) << "kallsyms_offsets not found, absolute kallsyms_addresses are not supported";
+            continue;
+        }
+
+        tables = candidate;
+        return true;
+    }
+    return false;
+}
+
+bool decode_kallsyms(std::string_view image, const KallsymsTables& tables, SymbolIndex& symbols, uintptr_t fallback_base)
+{
+    TokenTable table {};
+    if (not load_token_table(image, tables.token_table, tables.token_index, table)) {
+        return false;
+    }
+
+    auto base = read_as<uint64_t>(image, tables.relative_base);
+    if (base == 0) {
+        base = fallback_base;
+    }
+
+    symbols.reserve(symbols.size() + tables.count, tables.markers - tables.names);
+
+    ExpandedName name {};
+    size_t iter = tables.names;
+    for (uint32_t i = 0; i < tables.count; ++i) {
+        iter = expand_name(image, iter, table, name);
+        if (iter == 0) {
+            return false;
+        }
+
+        uintptr_t address = base + read_as<uint32_t>(image, tables.offsets + i * 4);
+        symbols.add({ name.data + 1, name.size - 1 }, address, name.data[0]);
+    }
+    return true;
+}
@@ -0,0 +1,153 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __kallsyms_h__
+#define __kallsyms_h__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "buffer.h"
+
+struct Symbol {
+    uintptr_t address;
+    uint32_t name; // offset in the arena
+    uint16_t size;
+    char type;
+};
+
+/*
+    Symbols the analysis passes need, the names must outlive the request.
+
+    Symbol maps are address ordered. Once every required symbol is found
+    and the fence symbol is passed, the optional symbols that are placed
+    before the fence are known to be absent and loading can stop. Late
+    symbols are optional too, but may be placed after the fence, loading
+    goes on until they are seen.
+*/
+class SymbolRequest {
+    std::unordered_map<std::string_view, bool> _names {}; // name -> required
+    std::unordered_set<std::string_view> _late {};
+    std::string_view _fence {};
+    size_t _required { 0 };
+
+public:
+    void require(std::string_view name);
+    void want(std::string_view name);
+    void want_late(std::string_view name);
+    void fence(std::string_view name);
+
+    // returns nullptr if the name is not requested, otherwise whether it is required
+    const bool* find(std::string_view name) const;
+
+    bool late(std::string_view name) const { return _late.count(name) != 0; }
+
+    std::string_view fence() const { return _fence; }
+    size_t size() const { return _names.size(); }
+    size_t required() const { return _required; }
+    size_t late() const { return _late.size(); }
+};
+
+/*
+    Compact kernel symbol table.
+
+    Names live NUL terminated in one arena, the entries point into it by
+    offset. Lookup by name is an open addressing table of entry indices,
+    the address and name ordered views are built on first use.
+*/
+class SymbolIndex {
+    ImageBuffer _arena {};
+    std::vector<Symbol> _symbols {};
+    std::vector<uint32_t> _table {}; // entry index + 1, 0 for empty slots
+
+    mutable std::vector<uint32_t> _by_address {};
+    mutable std::vector<uint32_t> _by_name {};
+
+    void append_name(std::string_view name, Symbol& symbol);
+    void insert(uint32_t index);
+    void rehash(size_t capacity);
+    void parse(size_t size);
+    bool load_requested(int fd, const SymbolRequest& request);
+
+public:
+    // parse a System.map or /proc/kallsyms, with a request only the requested symbols are kept
+    bool load(const std::string& filename, const SymbolRequest* request = nullptr);
+
+    void add(std::string_view name, uintptr_t address, char type);
+
+    // room for `count` symbols with `names` bytes of names
+    void reserve(size_t count, size_t names);
+
+    // the first symbol with this name
+    const Symbol* find(std::string_view name) const;
+
+    std::string_view name_of(const Symbol& symbol) const
+    {
+        return { _arena.data() + symbol.name, symbol.size };
+    }
+
+    const char* c_name_of(const Symbol& symbol) const
+    {
+        return _arena.data() + symbol.name;
+    }
+
+    // the lowest symbol address above `address`, 0 if there is none
+    uintptr_t next_address(uintptr_t address) const;
+
+    const std::vector<uint32_t>& by_address() const;
+    const std::vector<uint32_t>& by_name() const;
+
+    const Symbol& operator[](uint32_t index) const { return _symbols[index]; }
+
+    size_t size() const { return _symbols.size(); }
+    bool empty() const { return _symbols.empty(); }
+};
+
+/*
+    kallsyms tables compiled into the kernel image (scripts/kallsyms.c),
+    CONFIG_KALLSYMS_BASE_RELATIVE only. Offsets are from the start of the
+    image.
+
+    before 6.4: offsets, relative_base, num_syms, names, markers,
+                [seqs_of_names,] token_table, token_index
+    6.4 and later: num_syms, names, markers, token_table, token_index,
+                offsets, relative_base, seqs_of_names
+*/
+struct KallsymsTables {
+    size_t num_syms { 0 };
+    size_t names { 0 };
+    size_t markers { 0 };
+    size_t token_table { 0 };
+    size_t token_index { 0 };
+    size_t offsets { 0 };
+    size_t relative_base { 0 };
+    uint32_t count { 0 };
+};
+
+bool find_kallsyms_tables(std::string_view image, KallsymsTables& tables);
+
+/*
+    Expand every symbol into `symbols`. kallsyms_relative_base is a boot
+    time relocation on relocatable kernels and reads 0 in the image, the
+    symbols are then placed relative to `fallback_base`.
+*/
+bool decode_kallsyms(std::string_view image, const KallsymsTables& tables, SymbolIndex& symbols, uintptr_t fallback_base);
+
+#endif
@@ -25,173 +25,375 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <filesystem>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 
-#include "zlib.h"
-
 #include "kdeploy.h"
+#include "bootimg.h"
+#include "decompress.h"
 #include "disasm.h"
+#include "find_symbol_crc_unicorn.h"
+#include "ksymtab.h"
+#include "live.h"
+#include "module.h"
+#include "passes.h"
+#include "profile.h"
+#include "serve.h"
 #include "utils.h"
+#include "vmlinux.h"
 
 #include "kagent/private.h"
 
 namespace po = boost::program_options;
 
-template <typename S>
-typename std::enable_if<S::method == KernelSymbolMethod::Offset, ssize_t>::
-    type
-    find_symbol(KernelInformation& ki, const std::string_view& symbol_name, S* begin, S* end)
+enum class CrcSource {
+    Static, // kcrctab
+    Emulate, // the kernel's find_symbol
+    Verify, // kcrctab, cross-checked by emulation
+};
+
+std::tuple<bool, unsigned long> find_symbol_crc(
+    KernelInformation& ki,
+    const std::string_view& symbol_name,
+    std::vector<SymbolTable>& sym_tables,
+    const KsymtabIndex& ksymtab)
 {
-    for (auto* iter = begin; iter != end; ++iter) {
-        auto* name = reinterpret_cast<char*>(&iter->name_offset) + iter->name_offset;
-        if (symbol_name == name) {
-            return iter - begin;
-        }
+    auto* entry = ksymtab.find(symbol_name);
+    if (entry == nullptr) {
+        return { false, 0u };
+    }
+
+    auto& table = sym_tables[entry->table];
+
+    unsigned long crc = 0;
+    if (table.crc_size == sizeof(uint32_t)) {
+        crc = reinterpret_cast<uint32_t*>(table.crc_start_ptr)[entry->index];
+    } else {
+        crc = reinterpret_cast<unsigned long*>(table.crc_start_ptr)[entry->index];
+    }
+
+    // BOOST_LOG_TRIVIAL(debug) << "found sym " << symbol_name << " index " << entry->index << " crc " << (void*)crc << " reloated-kcrctabl " << ki.ARCH_RELOCATES_KCRCTAB;
+    if (ki.ARCH_RELOCATES_KCRCTAB) {
+        return {
+            true,
+            // crc - ki.kaslr
+
+            // __relocate_kernel did not touch the crc value
+            crc - (ki.get_symbol("_text") - ki.load_offset - ki.default_base)
+        };
     }
-    return -1;
+    return { true, crc };
 }
 
-template <typename S>
-typename std::enable_if<S::method == KernelSymbolMethod::Abs, ssize_t>::
-    type
-    find_symbol(KernelInformation& ki, const std::string_view& symbol_name, S* begin, S* end)
+/*
+    Placement of the embedded kallsyms when kallsyms_relative_base is left
+    to the boot time relocation. Offsets from _text hold, the base itself
+    is made up, so nothing may depend on the absolute address of _text.
+*/
+constexpr uintptr_t unrelocated_kallsyms_base = 0xffffffc008000000;
+
+void resolve_key_symbols(KernelInformation& ki)
 {
-    for (auto* iter = begin; iter < end; ++iter) {
-        // BOOST_LOG_TRIVIAL(debug) << "symbol addr " << (void*)iter->name;
-        
-        if (symbol_name == iter->name) {
-            // BOOST_LOG_TRIVIAL(debug) << "symbol " << symbol_name << " ptr: " << (void*)iter->value << " relative to buffer: " << (void*)ki.buffer_offset_of_ptr(iter);
-            return iter - begin;
-        }
+    ki.sym_text = ki.get_symbol("_text");
+
+    ki.sym_delete_modulem = ki.find_symbol("sys_delete_module");
+    if (ki.sym_delete_modulem == 0) {
+        ki.sym_delete_modulem = ki.get_symbol("__do_sys_delete_module.constprop.0");
     }
-    return -1;
+
+    ki.sym_module_get_kallsym = ki.get_symbol("module_get_kallsym");
+    ki.sym_vermagic = ki.get_symbol("vermagic");
 }
 
-std::tuple<bool, unsigned long> find_symbol_crc(
-    KernelInformation& ki,
-    const std::string_view& symbol_name,
-    std::vector<SymbolTable>& sym_tables)
+/*
+    Symbols the analysis passes look up. create_pgd_mapping is __init on
+    arm64 and follows rodata, it is read for `pgd` while the modules that
+    may need it are still loading, whether it is missing is decided later.
+*/
+SymbolRequest analysis_symbols(bool emulate, bool pgd)
 {
-    for (auto& table : sym_tables) {
-        ssize_t index = -1;
-        switch (ki.symbol_struct_type) {
-        case KernelSymbolStructType::V1: {
-            auto* begin = reinterpret_cast<KernelSymbol1*>(table.symbol_start_ptr);
-            auto* end = reinterpret_cast<KernelSymbol1*>(table.symbol_stop_ptr);
-            index = find_symbol(ki, symbol_name, begin, end);
-            break;
-        }
-        case KernelSymbolStructType::V2: {
-            auto* begin = reinterpret_cast<KernelSymbol2*>(table.symbol_start_ptr);
-            auto* end = reinterpret_cast<KernelSymbol2*>(table.symbol_stop_ptr);
-            index = find_symbol(ki, symbol_name, begin, end);
-            break;
-        }
-        case KernelSymbolStructType::V3: {
-            auto* begin = reinterpret_cast<KernelSymbol3*>(table.symbol_start_ptr);
-            auto* end = reinterpret_cast<KernelSymbol3*>(table.symbol_stop_ptr);
-            index = find_symbol(ki, symbol_name, begin, end);
-            break;
-        }
-        case KernelSymbolStructType::V4: {
-            auto* begin = reinterpret_cast<KernelSymbol4*>(table.symbol_start_ptr);
-            auto* end = reinterpret_cast<KernelSymbol4*>(table.symbol_stop_ptr);
-            index = find_symbol(ki, symbol_name, begin, end);
-            break;
-        }
-        default:
-            throw std::runtime_error("unsupported kernel symbol type");
-        }
-        if (index != -1) {
-            auto* crc_ptr = reinterpret_cast<unsigned long*>(table.crc_start_ptr) + index;
-            // BOOST_LOG_TRIVIAL(debug) << "found sym " << symbol_name << " index " << index << " crc " << (void*)*crc_ptr << " reloated-kcrctabl " << ki.ARCH_RELOCATES_KCRCTAB;
-            if (ki.ARCH_RELOCATES_KCRCTAB) {
-                return {
-                    true,
-                    // *crc_ptr - ki.kaslr
+    SymbolRequest request {};
+
+    // key symbols
+    request.require("_text");
+    request.require("module_get_kallsym");
+    request.require("vermagic");
+    request.want("sys_delete_module");
+    request.want("__do_sys_delete_module.constprop.0");
+
+    // relocation and runtime information
+    request.want("__relocate_kernel");
+    request.want("kimage_vaddr");
+    if (pgd) {
+        request.want_late("create_pgd_mapping");
+    }
 
-                    // __relocate_kernel did not touch the crc value
-                    *crc_ptr - (ki.get_symbol("_text") - ki.load_offset - ki.default_base)
-                };
-            }
-            return { true, *crc_ptr };
+    // architecture of the kernel
+    request.want("startup_64");
+
+    // kernel identity of the profile, the notes follow rodata before 5.5
+    request.want_late("__start_notes");
+    request.want_late("__stop_notes");
+    request.want("linux_banner");
+
+    // symbol tables
+    for (auto* name : {
+             "__start___ksymtab", "__stop___ksymtab",
+             "__start___ksymtab_gpl", "__stop___ksymtab_gpl",
+             "__start___ksymtab_gpl_future", "__stop___ksymtab_gpl_future",
+             "__start___kcrctab", "__stop___kcrctab",
+             "__start___kcrctab_gpl", "__stop___kcrctab_gpl",
+             "__start___kcrctab_gpl_future", "__stop___kcrctab_gpl_future" }) {
+        request.want(name);
+    }
+
+    // UnicornSnapshot
+    if (emulate) {
+        request.want("_head");
+        for (auto* name : { "_end", "find_symbol", "kimage_vaddr" }) {
+            request.require(name);
         }
     }
-    return { false, 0u };
+
+    // 6.4 and later have no __relocate_kernel. The tables follow the fence
+    // and are only seen when the map is read further, e.g. for _end
+    for (auto* name : { "__rela_start", "__rela_end", "__relr_start", "__relr_end" }) {
+        request.want(name);
+    }
+
+    // the other optional symbols are placed before the end of rodata
+    request.fence("__end_rodata");
+
+    return request;
 }
 
-[[gnu::weak]] int main(int argc, const char* argv[])
+// bytes of the image, counted from _text, the analysis reads before relocation. 0 for all
+size_t analysis_extent(KernelInformation& ki)
 {
-    KernelInformation ki {};
+    // __ksymtab_strings follows the last kcrctab and ends before __end_rodata
+    auto end = ki.find_symbol("__end_rodata");
+    if (end == 0) {
+        return 0;
+    }
 
-    std::string module_file;
-    std::string boot_partition;
-    std::string kernel;
-    std::string output_file;
-    std::string symbol_map;
+    for (auto* name : {
+             "__stop___ksymtab", "__stop___ksymtab_gpl", "__stop___ksymtab_gpl_future",
+             "__stop___kcrctab", "__stop___kcrctab_gpl", "__stop___kcrctab_gpl_future" }) {
+        end = std::max(end, ki.find_symbol(name));
+    }
 
-    try {
-        po::options_description desc("Allowed options");
+    // disassembly windows
+    for (auto addr : {
+             ki.sym_delete_modulem,
+             ki.sym_module_get_kallsym,
+             ki.find_symbol("__relocate_kernel"),
+             ki.find_symbol("create_pgd_mapping") }) {
+        if (addr != 0) {
+            end = std::max(end, addr + 0x1000);
+        }
+    }
 
-        desc.add_options()("help", "show help message");
-        desc.add_options()("module,m", po::value<std::string>(), "module file");
-        desc.add_options()("boot,b", po::value<std::string>(), "boot partition");
-        desc.add_options()("kernel,k", po::value<std::string>(), "kernel image");
-        desc.add_options()("symbol-map,s", po::value<std::string>(), "symbol map");
-        desc.add_options()("output,o", po::value<std::string>()->default_value("out.ko"), "output file");
+    return end - ki.sym_text;
+}
 
-        po::variables_map vm;
-        po::store(po::parse_command_line(argc, argv, desc), vm);
-        po::notify(vm);
+struct ResolvedCrc {
+    unsigned long crc;
+    unsigned long emulated_crc;
+    bool found;
+    bool mismatch; // kcrctab and emulation disagree
+};
 
-        if (vm.count("help")) {
-            std::cout << desc << std::endl;
-            return 0;
+// the crc of name_of(i) for i in [0, count), resolved in parallel
+template <typename F>
+std::vector<ResolvedCrc> resolve_crcs(
+    KernelInformation& ki,
+    CrcSource crc_source,
+    UnicornPool* emulator,
+    std::vector<SymbolTable>& sym_tables,
+    const KsymtabIndex& ksymtab,
+    size_t count,
+    F&& name_of)
+{
+    std::vector<ResolvedCrc> results(count, ResolvedCrc {});
+
+    parallel_for(count, emulator ? 4 : 32, [&](size_t begin, size_t end) {
+        std::unique_ptr<UnicornSession> session {};
+        if (emulator) {
+            session = emulator->acquire();
         }
 
-        if (vm.count("module")) {
-            module_file = vm["module"].as<std::string>();
+        auto release_session = ScopeTail([&]() {
+            if (session) {
+                emulator->release(std::move(session));
+            }
+        });
+
+        for (size_t i = begin; i < end; ++i) {
+            auto& result = results[i];
+            std::string_view name = name_of(i);
+
+            if (crc_source != CrcSource::Emulate) {
+                std::tie(result.found, result.crc) = find_symbol_crc(ki, name, sym_tables, ksymtab);
+            }
+
+            if (session) {
+                auto [emulated, emulated_crc] = session->find_symbol_crc(name);
+                result.emulated_crc = emulated_crc;
+
+                if (crc_source == CrcSource::Emulate) {
+                    result.found = emulated;
+                    result.crc = emulated_crc;
+                } else if (emulated and (not result.found or result.crc != emulated_crc)) {
+                    result.mismatch = true;
+                    if (not result.found) {
+                        result.found = true;
+                        result.crc = emulated_crc;
+                    }
+                }
+            }
         }
+    });
 
-        if (vm.count("boot")) {
-            boot_partition = vm["boot"].as<std::string>();
+    return results;
+}
+
+// where the kernel of one analysis comes from
+struct KernelSource {
+    std::string kernel {};
+    std::string boot_partition {};
+    std::string symbol_map {}; // empty for the running kernel
+    bool all_symbols { false };
+    bool image_symbols { false };
+    bool live { false };
+    CrcSource crc_source { CrcSource::Static };
+};
+
+/*
+    Analyse one kernel into `profile`. modules_ready() is called once the
+    modules are needed, they decide what is resolved unless `all_exported`
+    asks for every exported symbol.
+*/
+static int analyse_kernel(const KernelSource& source, std::vector<ModuleJob>& jobs,
+    const std::function<bool()>& modules_ready, bool all_exported, KernelProfile& profile)
+{
+    KernelInformation ki {};
+
+    auto& kernel = source.kernel;
+    auto& boot_partition = source.boot_partition;
+    auto symbol_map = source.symbol_map;
+    auto all_symbols = source.all_symbols;
+    auto image_symbols = source.image_symbols;
+    auto live = source.live;
+    auto crc_source = source.crc_source;
+
+    // open kernel image
+    std::unique_ptr<PayloadStream> payload {};
+    std::unique_ptr<ElfKernel> elf {};
+    Kcore kcore {};
+
+    // known from the ELF headers of vmlinux, otherwise detected from the image
+    std::optional<KernelArch> arch {};
+
+    // the vmlinux of a bzImage is decompressed with its ELF headers, _text is found by the segments
+    std::optional<ElfSegments> payload_segments {};
+    ssize_t text_offset { 0 };
+
+    if (live) {
+        if (not kcore.open()) {
+            BOOST_LOG_TRIVIAL(error) << "Unable read /proc/kcore";
+            return -1;
         }
 
-        if (vm.count("kernel")) {
-            kernel = vm["kernel"].as<std::string>();
+    } else if (not kernel.empty()) {
+        auto kernel_fd = UniqueFD{::open(kernel.c_str(), O_RDONLY)};
+        if (not kernel_fd) {
+            BOOST_LOG_TRIVIAL(error) << "Unable open " << kernel;
+            return -1;
         }
 
-        if (vm.count("symbol-map")) {
-            symbol_map = vm["symbol-map"].as<std::string>();
+        std::array<char, 1024> head {};
+        auto sz = ::pread(kernel_fd.get(), head.data(), head.size(), 0);
+        if (sz <= 0) {
+            BOOST_LOG_TRIVIAL(error) << "Empty kernel image " << kernel;
+            return -1;
         }
 
-        output_file = vm["output"].as<std::string>();
+        BzImage bzimage {};
 
-    } catch (std::exception& e) {
-        BOOST_LOG_TRIVIAL(error) << "error: " << e.what();
-        return 1;
-    }
+        if (sz >= SELFMAG and memcmp(head.data(), ELFMAG, SELFMAG) == 0) {
+            // vmlinux, the sections are mapped in place
+            elf = std::make_unique<ElfKernel>();
+            if (not elf->open(std::move(kernel_fd))) {
+                BOOST_LOG_TRIVIAL(error) << "Unsupported ELF kernel " << kernel;
+                return -1;
+            }
+
+            arch = elf_kernel_arch(elf->machine());
+            if (not arch) {
+                BOOST_LOG_TRIVIAL(error) << "Unsupported vmlinux machine " << elf->machine();
+                return -1;
+            }
 
-    std::vector<char> module_ko = read_file(module_file);
+        } else if (parse_bzimage({ head.data(), static_cast<size_t>(sz) }, bzimage)) {
+            std::array<char, 64> payload_head {};
+            if (::pread(kernel_fd.get(), payload_head.data(), payload_head.size(), bzimage.payload.offset) != payload_head.size()) {
+                BOOST_LOG_TRIVIAL(error) << "bzImage payload out of file";
+                return -1;
+            }
 
-    // read module.ko
-    if (module_ko.empty()) {
-        BOOST_LOG_TRIVIAL(error) << "Empty file " << module_file;
-        return -1;
-    }
+            auto format = detect_payload({ payload_head.data(), payload_head.size() });
+            if (format == PayloadFormat::Unknown or format == PayloadFormat::Raw) {
+                BOOST_LOG_TRIVIAL(error) << "Unsupported bzImage payload";
+                return -1;
+            }
 
-    BOOST_LOG_TRIVIAL(debug) << "module file size " << module_ko.size();
+            BOOST_LOG_TRIVIAL(debug) << "bzImage boot protocol " << (bzimage.version >> 8) << "." << (bzimage.version & 0xff)
+                                     << ", " << payload_format_name(format) << " payload at 0x" << std::hex << bzimage.payload.offset
+                                     << "+0x" << bzimage.payload.size << std::dec;
 
-    // read kernel image
-    if (not kernel.empty()) {
-        ki.buffer = read_file(kernel);
+            // the program headers follow the ELF header
+            try {
+                payload = open_payload(format, std::move(kernel_fd), bzimage.payload.offset, bzimage.payload.size);
+                payload->decompress(ki.buffer, 4096);
+            } catch (std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << e.what();
+                return -1;
+            }
+
+            ElfSegments segments {};
+            if (not parse_elf_segments({ ki.buffer.data(), ki.buffer.size() }, segments)) {
+                BOOST_LOG_TRIVIAL(error) << "bzImage payload is not an ELF vmlinux";
+                return -1;
+            }
+
+            arch = elf_kernel_arch(segments.machine);
+            payload_segments = std::move(segments);
+
+        } else {
+            // vmlinux.bin and other raw images without a known header
+            auto format = detect_payload({ head.data(), static_cast<size_t>(sz) });
+            if (format == PayloadFormat::Unknown) {
+                format = PayloadFormat::Raw;
+            }
+
+            try {
+                payload = open_payload(format, std::move(kernel_fd), 0);
+            } catch (std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << e.what();
+                return -1;
+            }
+        }
 
     } else if (not boot_partition.empty()) {
         auto boot_fd = UniqueFD{::open(boot_partition.c_str(), O_RDONLY)};
@@ -200,62 +402,78 @@ std::tuple<bool, unsigned long> find_symbol_crc(
             return -1;
         }
 
-        ki.buffer.resize(8192);
+        std::array<char, 8192> head {};
 
         // read boot
-        auto sz = ::read(boot_fd.get(), ki.buffer.data(), ki.buffer.size());
-        if (sz != ki.buffer.size()) {
+        auto sz = ::read(boot_fd.get(), head.data(), head.size());
+        if (sz != head.size()) {
             BOOST_LOG_TRIVIAL(error) << "boot partition too small";
             return -1;
         }
 
-        // find zImage
-        auto* ptr = memmem(ki.buffer.data(), ki.buffer.size(), "\x1F\x8B\x08\x00", 4);
-        if (ptr == nullptr) {
-            BOOST_LOG_TRIVIAL(error) << "zImage not found";
-            return -1;
-        }
+        PayloadFormat format { PayloadFormat::Unknown };
+        off_t payload_offset { 0 };
+        size_t payload_size { 0 };
 
-        auto zImage_offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(ki.buffer.data());
-        ::lseek(boot_fd.get(), zImage_offset, SEEK_SET);
+        BootImage boot_image {};
+        if (parse_boot_image({ head.data(), head.size() }, boot_image)) {
+            BOOST_LOG_TRIVIAL(debug) << "boot image v" << boot_image.header_version
+                                     << " page size " << boot_image.page_size
+                                     << " kernel 0x" << std::hex << boot_image.kernel.offset << "+0x" << boot_image.kernel.size
+                                     << " ramdisk 0x" << boot_image.ramdisk.offset << "+0x" << boot_image.ramdisk.size
+                                     << " second 0x" << boot_image.second.offset << "+0x" << boot_image.second.size << std::dec;
 
-        // unzip
-        {
-            ki.buffer.clear();
-            ki.buffer.resize(64 * 1024 * 1024);
+            if (boot_image.vendor or boot_image.kernel.size == 0) {
+                BOOST_LOG_TRIVIAL(error) << "boot image without kernel";
+                return -1;
+            }
+
+            payload_offset = boot_image.kernel.offset;
+            payload_size = boot_image.kernel.size;
+
+            std::array<char, 64> kernel_head {};
+            if (::pread(boot_fd.get(), kernel_head.data(), kernel_head.size(), payload_offset) != kernel_head.size()) {
+                BOOST_LOG_TRIVIAL(error) << "boot partition too small";
+                return -1;
+            }
 
-            gzFile file = gzdopen(boot_fd.get(), "rb");
-            int ret = gzread(file, ki.buffer.data(), ki.buffer.size());
-            if (ret == -1) {
-                BOOST_LOG_TRIVIAL(error) << "failed to decompress zImage";
+            format = detect_payload({ kernel_head.data(), kernel_head.size() });
+            if (format == PayloadFormat::Unknown) {
+                format = PayloadFormat::Raw;
+            }
+
+        } else {
+            // not an android boot image, find kernel payload
+            payload_offset = find_payload({ head.data(), head.size() }, &format);
+            if (payload_offset == -1) {
+                BOOST_LOG_TRIVIAL(error) << "kernel payload not found";
                 return -1;
             }
-            gzclose(file);
-            ki.buffer.resize(ki.buffer.size() - ret);
         }
+
+        BOOST_LOG_TRIVIAL(debug) << payload_format_name(format) << " kernel payload at 0x" << std::hex << payload_offset << std::dec;
+
+        try {
+            payload = open_payload(format, std::move(boot_fd), payload_offset, payload_size);
+        } catch (std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << e.what();
+            return -1;
+        }
+
     } else {
         BOOST_LOG_TRIVIAL(error) << "Do not known how to find kernel";
         return -1;
     }
 
-    BOOST_LOG_TRIVIAL(debug) << "kernel buffer " << (void*)ki.buffer.data();
-    {
-        struct Aarch64KernelHeader {
-            void* b;
-            uint64_t offset;
-            uint64_t size;
-        };
-
-        auto* hdr = reinterpret_cast<Aarch64KernelHeader*>(ki.buffer.data());
-
-        ki.load_offset = hdr->offset;
-        ki.load_size = hdr->size;
+    if (not live and not payload and not elf) {
+        BOOST_LOG_TRIVIAL(error) << "Unsupported kernel payload";
+        return -1;
     }
 
     // get kallsyms
 
     // echo "1" > /proc/sys/kernel/kptr_restrict
-    if (symbol_map.empty()) {
+    if (symbol_map.empty() and not image_symbols and not (elf and elf->has_symbols())) {
         if (not write_file("/proc/sys/kernel/kptr_restrict", "1")) {
             BOOST_LOG_TRIVIAL(error) << "Failed to write \"1\" to /proc/sys/kernel/kptr_restrict";
             return -1;
@@ -263,42 +481,151 @@ std::tuple<bool, unsigned long> find_symbol_crc(
         symbol_map = "/proc/kallsyms";
     }
 
-    // read kernel symbol map
-    {
-        FILE* fp = fopen(symbol_map.c_str(), "rb");
-        if (fp == nullptr) {
-            BOOST_LOG_TRIVIAL(error) << "Unable open /proc/kallsyms";
+    if (image_symbols) {
+        // the kallsyms tables sit at the end of rodata
+        uintptr_t elf_text { 0 };
+        if (elf) {
+            elf_text = elf->text_address();
+            ki.buffer = elf->map_image(elf_text);
+        } else {
+            try {
+                payload->decompress(ki.buffer);
+            } catch (std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << e.what();
+                return -1;
+            }
+        }
+
+        KallsymsTables tables {};
+        if (not find_kallsyms_tables({ ki.buffer.data(), ki.buffer.size() }, tables)) {
+            BOOST_LOG_TRIVIAL(error) << "kallsyms tables not found in kernel image";
             return -1;
         }
 
-        char line[BUFSIZ];
-        char name[BUFSIZ];
+        BOOST_LOG_TRIVIAL(debug) << "kallsyms " << tables.count << " symbols"
+                                 << " names 0x" << std::hex << tables.names
+                                 << " token table 0x" << tables.token_table
+                                 << " offsets 0x" << tables.offsets << std::dec;
+
+        if (not decode_kallsyms({ ki.buffer.data(), ki.buffer.size() }, tables, ki.kallsyms, unrelocated_kallsyms_base)) {
+            BOOST_LOG_TRIVIAL(error) << "Unable decode kallsyms";
+            return -1;
+        }
+
+        resolve_key_symbols(ki);
+
+        if (elf and elf_text != ki.sym_text) {
+            ki.buffer = elf->map_image(ki.sym_text);
+        }
 
-        while (fgets(line, sizeof(line), fp) != nullptr) {
-            uintptr_t ptr { 0 };
-            char type { 0 };
+        if (payload_segments) {
+            text_offset = payload_segments->file_offset(ki.sym_text);
+        }
+    } else {
+        // decompress ahead while the symbol map is read, until the symbols tell how far the analysis reads
+        std::atomic<size_t> extent { SIZE_MAX };
+        std::atomic<bool> cancelled { false };
+
+        std::future<void> decompress {};
+        if (payload) {
+            decompress = std::async(std::launch::async, [&]() {
+                constexpr size_t step = 4 << 20;
+                while (not payload->finished() and not cancelled and ki.buffer.size() < extent) {
+                    payload->decompress(ki.buffer, ki.buffer.size() + step);
+                }
+            });
+        }
 
-            if (sscanf(line, "%" SCNxPTR " %c %s", &ptr, &type, name) == 3) {
-                ki.kallsyms.emplace(std::pair<std::string, uintptr_t> { name, ptr });
+        // runs before the future waits
+        auto cancel = ScopeTail([&]() {
+            cancelled = true;
+        });
+
+        // read kernel symbol map, stop as soon as the analysis has what it needs.
+        // only arm64 has a pgd offset, an unknown arch may be arm64
+        auto request = analysis_symbols(crc_source != CrcSource::Static, not arch or *arch == KernelArch::Arm64);
+        if (elf and symbol_map.empty()) {
+            if (not elf->load_symbols(ki.kallsyms, all_symbols ? nullptr : &request)) {
+                BOOST_LOG_TRIVIAL(error) << "Unable read vmlinux symbols";
+                return -1;
             }
+        } else if (not ki.kallsyms.load(symbol_map, all_symbols ? nullptr : &request)) {
+            BOOST_LOG_TRIVIAL(error) << "Unable read " << symbol_map;
+            return -1;
+        }
+
+        BOOST_LOG_TRIVIAL(debug) << "symbol count " << ki.kallsyms.size();
+
+        resolve_key_symbols(ki);
+
+        if (payload_segments) {
+            text_offset = payload_segments->file_offset(ki.sym_text);
         }
 
-        fclose(fp);
+        // 0 for the whole image
+        auto wanted = analysis_extent(ki);
+        extent = wanted == 0 or text_offset == -1 ? SIZE_MAX : text_offset + wanted;
+
+        if (elf) {
+            // relocation reads the tables of the init sections
+            ki.buffer = elf->map_image(ki.sym_text, arch_backend(*arch).relocate_kernel != nullptr ? 0 : wanted);
+        }
+
+        // a truncated or corrupt payload is rethrown here
+        if (decompress.valid()) {
+            try {
+                decompress.get();
+            } catch (std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << e.what();
+                return -1;
+            }
+        }
     }
 
-    BOOST_LOG_TRIVIAL(debug) << "symbol count " << ki.kallsyms.size();
+    if (live) {
+        // only what the analysis reads, already relocated by the running kernel
+        read_live_image(ki, kcore);
+    }
 
-    // find key symbol
-    {
-        ki.sym_text = ki.get_symbol("_text");
+    if (text_offset == -1) {
+        BOOST_LOG_TRIVIAL(error) << "_text is not loaded by the vmlinux segments";
+        return -1;
+    }
 
-        ki.sym_delete_modulem = ki.find_symbol("sys_delete_module");
-        if (ki.sym_delete_modulem == 0) {
-            ki.sym_delete_modulem = ki.get_symbol("__do_sys_delete_module.constprop.0");
+    if (text_offset != 0) {
+        if (text_offset % sysconf(_SC_PAGESIZE) != 0) {
+            BOOST_LOG_TRIVIAL(error) << "vmlinux segment of _text is not page aligned";
+            return -1;
         }
+        ki.buffer.drop_front(text_offset);
+    }
+
+    if (ki.buffer.empty()) {
+        BOOST_LOG_TRIVIAL(error) << "Empty kernel image";
+        return -1;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "kernel image " << ki.buffer.size() << " bytes"
+                             << (payload and payload->finished() ? "" : " (partial)");
+
+    BOOST_LOG_TRIVIAL(debug) << "kernel buffer " << (void*)ki.buffer.data();
+
+    // the passes follow the kernel, not the host
+    ki.arch = arch ? *arch : detect_kernel_arch(ki);
+    auto& backend = arch_backend(ki.arch);
+    BOOST_LOG_TRIVIAL(debug) << "kernel arch " << backend.name;
 
-        ki.sym_module_get_kallsym = ki.get_symbol("module_get_kallsym");
-        ki.sym_vermagic = ki.get_symbol("vermagic");
+    if (ki.arch == KernelArch::Arm64) {
+        struct Aarch64KernelHeader {
+            void* b;
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        auto* hdr = reinterpret_cast<Aarch64KernelHeader*>(ki.buffer.data());
+
+        ki.load_offset = hdr->offset;
+        ki.load_size = hdr->size;
     }
 
     // uintptr_t delete_module_offset = sym_delete_modulem - sym_text;
@@ -311,107 +638,118 @@ std::tuple<bool, unsigned long> find_symbol_crc(
     // BOOST_LOG_TRIVIAL(debug) << "sym_vermagic_offset 0x" << std::hex << sym_vermagic_offset << std::dec;
     // BOOST_LOG_TRIVIAL(debug) << "sym_module_get_kallsym_offset 0x" << std::hex << sym_module_get_kallsym_offset << std::dec;
 
-    // disassemble sys_delete_module
-    // find offset of mod->init and mod->exit
-    auto [module_init_offset, module_exit_offset] = get_module_layout(ki.ptr_of_sym(ki.sym_delete_modulem));
+    /*
+        The analysis results, computed on first use after the passes they
+        depend on. Only what the modules need is asked for, unless the
+        profile outlives this run.
+    */
 
-    BOOST_LOG_TRIVIAL(debug) << "module_init_offset 0x" << std::hex << module_init_offset << std::dec;
-    BOOST_LOG_TRIVIAL(debug) << "module_exit_offset 0x" << std::hex << module_exit_offset << std::dec;
+    // one disassembly session for all passes, decoded functions are kept
+    Pass<std::unique_ptr<Disassembler>> disasm { "disassembler", {}, [&]() {
+        return std::make_unique<Disassembler>(ki);
+    } };
 
     // read vermagic and kernel version
-    std::string vermagic { ki.ptr_of_sym<char*>(ki.sym_vermagic) };
-    BOOST_LOG_TRIVIAL(info) << "vermagic: " << vermagic;
+    Pass<std::string> vermagic { "vermagic", {}, [&]() {
+        std::string vermagic { ki.ptr_of_sym<char*>(ki.sym_vermagic) };
+        BOOST_LOG_TRIVIAL(info) << "vermagic: " << vermagic;
 
-    if (sscanf(vermagic.c_str(), "%d.%d.%d", &ki.major, &ki.minor, &ki.revision) < 2) {
-        BOOST_LOG_TRIVIAL(debug) << "Invalid vermagic";
-        return -1;
-    }
-    BOOST_LOG_TRIVIAL(info) << "kernel version: " << ki.major << "." << ki.minor;
+        if (sscanf(vermagic.c_str(), "%d.%d.%d", &ki.major, &ki.minor, &ki.revision) < 2) {
+            throw std::runtime_error("Invalid vermagic");
+        }
+        BOOST_LOG_TRIVIAL(info) << "kernel version: " << ki.major << "." << ki.minor;
+        return vermagic;
+    } };
 
-    // get kernel symbol structure
+    // disassemble sys_delete_module
+    // find offset of mod->init and mod->exit
+    Pass<std::tuple<uintptr_t, uintptr_t>> module_layout { "module layout", { &disasm }, [&]() {
+        auto layout = get_module_layout(*disasm.get(), ki.sym_delete_modulem);
 
-    size_t kernel_symbol_size = 0;
+        BOOST_LOG_TRIVIAL(debug) << "module_init_offset 0x" << std::hex << std::get<0>(layout) << std::dec;
+        BOOST_LOG_TRIVIAL(debug) << "module_exit_offset 0x" << std::hex << std::get<1>(layout) << std::dec;
+        return layout;
+    } };
 
-    if (ki.version_old_then(4, 19, 0)) {
-        kernel_symbol_size = 2 * sizeof(void*);
-    } else {
-        kernel_symbol_size = get_kernel_symbol_size(ki.ptr_of_sym(ki.sym_module_get_kallsym));
-    }
+    // get kernel symbol structure
+    Pass<size_t> symbol_size { "kernel symbol size", { &vermagic, &disasm }, [&]() {
+        size_t kernel_symbol_size = 0;
 
-    if (kernel_symbol_size == 0) {
-        throw std::runtime_error("kernel_symbol_size not found");
-    }
+        if (ki.version_old_then(4, 19, 0)) {
+            kernel_symbol_size = 2 * sizeof(void*);
+        } else {
+            kernel_symbol_size = get_kernel_symbol_size(*disasm.get(), ki.sym_module_get_kallsym);
+        }
+
+        if (kernel_symbol_size == 0) {
+            throw std::runtime_error("kernel_symbol_size not found");
+        }
 
-    BOOST_LOG_TRIVIAL(debug) << "kernel_symbol_size " << kernel_symbol_size;
+        BOOST_LOG_TRIVIAL(debug) << "kernel_symbol_size " << kernel_symbol_size;
 
 #ifdef __LP64__
-    switch (kernel_symbol_size) {
-    case 8:
-        ki.symbol_struct_type = KernelSymbolStructType::V2;
-        break;
-    case 16:
-        ki.symbol_struct_type = KernelSymbolStructType::V1;
-        break;
-    case 12:
-        ki.symbol_struct_type = KernelSymbolStructType::V3;
-        break;
-    case 24:
-        ki.symbol_struct_type = KernelSymbolStructType::V4;
-        break;
-    }
+        switch (kernel_symbol_size) {
+        case 8:
+            ki.symbol_struct_type = KernelSymbolStructType::V2;
+            break;
+        case 16:
+            ki.symbol_struct_type = KernelSymbolStructType::V1;
+            break;
+        case 12:
+            ki.symbol_struct_type = KernelSymbolStructType::V3;
+            break;
+        case 24:
+            ki.symbol_struct_type = KernelSymbolStructType::V4;
+            break;
+        }
 #else
 #error "Unsupported arch"
 #endif
-
-    // relocate mod->{init, exit}
-    {
-        auto* header = reinterpret_cast<ElfW(Ehdr)*>(module_ko.data());
-        auto* shdr = reinterpret_cast<ElfW(Shdr)*>(reinterpret_cast<char*>(header) + header->e_shoff);
-        auto* shstrtab = reinterpret_cast<char*>(module_ko.data() + (shdr + header->e_shstrndx)->sh_offset);
-
-        ElfW(Rela) * this_module_rela { nullptr };
-        size_t rela_num { 0 };
-
-        SymbolVersion* versions { nullptr };
-        size_t vers_num { 0 };
-
-        for (int i = 0; i < header->e_shnum; ++i) {
-            if (std::string_view(shstrtab + shdr[i].sh_name) == ".rela.gnu.linkonce.this_module") {
-                this_module_rela = reinterpret_cast<ElfW(Rela)*>(reinterpret_cast<char*>(header) + shdr[i].sh_offset);
-                rela_num = shdr[i].sh_size / sizeof(ElfW(Rela));
+        return kernel_symbol_size;
+    } };
+
+    // null for static crcs
+    Pass<std::unique_ptr<UnicornPool>> emulator { "emulator", { &vermagic, &disasm }, [&]() {
+        std::unique_ptr<UnicornPool> emulator {};
+        if (crc_source != CrcSource::Static) {
+            if (ki.arch != KernelArch::Arm64) {
+                throw std::runtime_error("crc emulation of "s + backend.name + " kernels is not supported");
             }
-            if (std::string_view(shstrtab + shdr[i].sh_name) == "__versions") {
-                versions = reinterpret_cast<SymbolVersion*>(reinterpret_cast<char*>(header) + shdr[i].sh_offset);
-                vers_num = shdr[i].sh_size / sizeof(SymbolVersion);
+            if (payload and not payload->finished()) {
+                payload->decompress(ki.buffer);
             }
-            if (std::string_view(shstrtab + shdr[i].sh_name) == ".kagent.runtime.information") {
-                ki.runtime_info = reinterpret_cast<RuntimeInformation*>(reinterpret_cast<char*>(header) + shdr[i].sh_offset);
-            }
-        }
-
-        if (this_module_rela == nullptr) {
-            BOOST_LOG_TRIVIAL(debug) << ".rela.gnu.linkonce.this_module not found";
-            return -1;
+            emulator = std::make_unique<UnicornPool>(ki, *disasm.get());
         }
+        return emulator;
+    } };
 
-        for (int i = 0; i < rela_num; ++i) {
-            BOOST_LOG_TRIVIAL(debug) << "this_module rela " << i << " " << this_module_rela[i].r_offset;
-            if (this_module_rela[i].r_offset == offsetof(KernelModule, init)) {
-                this_module_rela[i].r_offset = module_init_offset;
-            }
-            if (this_module_rela[i].r_offset == offsetof(KernelModule, exit)) {
-                this_module_rela[i].r_offset = module_exit_offset;
+    // relocate kernel, emulation works on its own copy taken before
+    Pass<bool> relocation { "relocation", { &symbol_size, &emulator }, [&]() {
+        bool relocated { false };
+        if (live) {
+            // a relocatable arm64 kernel before 4.11 moved its crcs at boot, by a kaslr
+            // offset /proc/kcore only tells from 4.19 on
+            if (ki.arch == KernelArch::Arm64 and ki.version_old_then(4, 11, 0)
+                and (ki.find_symbol("__relocate_kernel") != 0 or ki.find_symbol("__rela_start") != 0)) {
+                throw std::runtime_error("--live can not read the relocated kcrctab of arm64 before 4.11, use the boot image");
             }
-        }
 
-        // relocate kernel
-        bool relocated { false };
-        if (ki.symbol_struct_type == KernelSymbolStructType::V1
-            or ki.symbol_struct_type == KernelSymbolStructType::V4) // TODO and KASLR
+            ki.kaslr = kcore.kernel_offset().value_or(0);
+            ki.default_base = ki.sym_text - ki.load_offset - ki.kaslr;
+
+        } else if (backend.relocate_kernel != nullptr
+            and (ki.symbol_struct_type == KernelSymbolStructType::V1
+                or ki.symbol_struct_type == KernelSymbolStructType::V4)) // TODO and KASLR
         {
-            auto __relocate_kernel = ki.find_symbol("__relocate_kernel");
-            if (__relocate_kernel != 0) {
-                arm64_relocate_kernel(ki, ki.ptr_of_sym(__relocate_kernel));
+            // the relocation table lives in the init section
+            if (payload and not payload->finished()) {
+                payload->decompress(ki.buffer);
+                BOOST_LOG_TRIVIAL(debug) << "decompressed " << ki.buffer.size() << " bytes";
+            }
+
+            if (ki.find_symbol("__relocate_kernel") != 0 or ki.find_symbol("__relr_start") != 0
+                or ki.find_symbol("__rela_start") != 0) {
+                backend.relocate_kernel(ki, *disasm.get());
                 relocated = true;
             }
             if (not relocated) {
@@ -420,6 +758,15 @@ std::tuple<bool, unsigned long> find_symbol_crc(
         }
 
         BOOST_LOG_TRIVIAL(debug) << "kernel buffer " << (void*)ki.buffer.data();
+        return relocated;
+    } };
+
+    // the crcs of the module symbols, or of every exported symbol
+    Pass<bool> crcs { "symbol crcs", { &symbol_size, &emulator, &relocation }, [&]() {
+        // the fix-up needs the real _text, the image symbols only have a made-up one
+        if (image_symbols and ki.ARCH_RELOCATES_KCRCTAB) {
+            throw std::runtime_error("--image-symbols can not fix up the relocated kcrctab before 4.11, use a symbol map");
+        }
 
         // resolve symbol
         std::vector<SymbolTable> sym_tables {};
@@ -476,115 +823,581 @@ std::tuple<bool, unsigned long> find_symbol_crc(
                       << " crc " << ki.offset<void*>(tbl.crc_start) << "-" << ki.offset<void*>(tbl.crc_stop)
                       << " " << tbl.name
                      ;
-            tbl.symbol_start_ptr = ki.ptr_of_sym(tbl.symbol_start);
-            tbl.symbol_stop_ptr = ki.ptr_of_sym(tbl.symbol_stop);
-            tbl.crc_start_ptr = ki.ptr_of_sym(tbl.crc_start);
-            tbl.crc_stop_ptr = ki.ptr_of_sym(tbl.crc_stop);
+            // the tables are the only relocated data the analysis reads
+            tbl.symbol_start_ptr = ki.ptr_of_sym(tbl.symbol_start, tbl.symbol_stop - tbl.symbol_start);
+            tbl.symbol_stop_ptr = ki.ptr_of_sym(tbl.symbol_stop, 0);
+            tbl.crc_start_ptr = ki.ptr_of_sym(tbl.crc_start, tbl.crc_stop - tbl.crc_start);
+            tbl.crc_stop_ptr = ki.ptr_of_sym(tbl.crc_stop, 0);
+        }
+
+        if (live) {
+            rebase_live_names(ki, sym_tables);
         }
 
         for (auto& tbl : sym_tables) {
             if (ki.symbol_struct_type == KernelSymbolStructType::V1
                 and ((tbl.symbol_stop - tbl.symbol_start) % sizeof(KernelSymbol1)) != 0) {
-                BOOST_LOG_TRIVIAL(error) << "Wrong kernel symbol type 1";
-                return -1;
+                throw std::runtime_error("Wrong kernel symbol type 1");
             }
             if (ki.symbol_struct_type == KernelSymbolStructType::V2
                 and ((tbl.symbol_stop - tbl.symbol_start) % sizeof(KernelSymbol2)) != 0) {
-                BOOST_LOG_TRIVIAL(error) << "Wrong kernel symbol type 2";
-                return -1;
+                throw std::runtime_error("Wrong kernel symbol type 2");
             }
             if (ki.symbol_struct_type == KernelSymbolStructType::V3
                 and ((tbl.symbol_stop - tbl.symbol_start) % sizeof(KernelSymbol3)) != 0) {
-                BOOST_LOG_TRIVIAL(error) << "Wrong kernel symbol type 3";
-                return -1;
+                throw std::runtime_error("Wrong kernel symbol type 3");
             }
             if (ki.symbol_struct_type == KernelSymbolStructType::V4
                 and ((tbl.symbol_stop - tbl.symbol_start) % sizeof(KernelSymbol4)) != 0) {
-                BOOST_LOG_TRIVIAL(error) << "Wrong kernel symbol type 4";
-                return -1;
+                throw std::runtime_error("Wrong kernel symbol type 4");
             }
         }
 
         BOOST_LOG_TRIVIAL(debug) << "kernel symbol type " << (int)ki.symbol_struct_type;
 
-        BOOST_LOG_TRIVIAL(debug) << "symbol count " << vers_num;
+        // kcrctab entries shrank to u32 in 4.11, derive their size from the table sizes
+        for (auto& tbl : sym_tables) {
+            size_t count = (tbl.symbol_stop - tbl.symbol_start) / symbol_size.get();
+            size_t crc_bytes = tbl.crc_stop - tbl.crc_start;
 
-        for (int i = 0; i < vers_num; ++i) {
-#if 0
-            std::tuple<bool, unsigned long> find_symbol_crc_unicorn(KernelInformation& ki, const std::string& name);
-            auto [found, crc] = find_symbol_crc_unicorn(ki, versions[i].name);
-#else
-            auto [found, crc] = find_symbol_crc(ki, versions[i].name, sym_tables);
-#endif
-            if (found) {
-                versions[i].crc = crc;
-                BOOST_LOG_TRIVIAL(info) << "crc " << (void*)(uintptr_t)crc << " " << versions[i].name;
+            if (count != 0 and crc_bytes == count * sizeof(uint32_t)) {
+                tbl.crc_size = sizeof(uint32_t);
             } else {
-                BOOST_LOG_TRIVIAL(error) << "NOT FOUND " << versions[i].name;
+                tbl.crc_size = sizeof(unsigned long);
+            }
+
+            BOOST_LOG_TRIVIAL(debug) << tbl.name << " " << count << " symbols, crc size " << tbl.crc_size;
+        }
+
+        KsymtabIndex ksymtab {};
+        ksymtab.build(ki, sym_tables);
+
+        BOOST_LOG_TRIVIAL(debug) << "ksymtab index " << ksymtab.size() << " symbols";
+
+        // the symbols of every module, or every exported symbol for later modules
+        std::vector<std::string_view> names {};
+        if (not all_exported) {
+            for (auto& job : jobs) {
+                for (size_t i = 0; i < job.sections.vers_num; ++i) {
+                    auto& version = job.sections.versions[i];
+                    names.emplace_back(version.name, strnlen(version.name, sizeof(version.name)));
+                }
+            }
+            std::sort(names.begin(), names.end());
+            names.erase(std::unique(names.begin(), names.end()), names.end());
+        } else {
+            for (auto& entry : ksymtab.entries()) {
+                names.emplace_back(entry.name, entry.size);
+            }
+        }
+
+        BOOST_LOG_TRIVIAL(debug) << "symbol count " << names.size();
+
+        // the tables and the index are read only from here on
+        auto resolved = resolve_crcs(ki, crc_source, emulator.get().get(), sym_tables, ksymtab, names.size(),
+            [&](size_t i) { return names[i]; });
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (resolved[i].found) {
+                profile.add_symbol(names[i], resolved[i].crc);
+            }
+            if (resolved[i].mismatch) {
+                BOOST_LOG_TRIVIAL(warning) << "crc mismatch " << names[i]
+                                           << " emulated " << (void*)(uintptr_t)resolved[i].emulated_crc;
             }
         }
+        profile.sort_symbols();
+        return true;
+    } };
+
+    Pass<uint64_t> mm_pgd_offset { "mm pgd offset", { &disasm }, [&]() {
+        if (backend.mm_pgd_offset == nullptr) {
+            throw std::runtime_error("pgd offset for "s + backend.name + " not available");
+        }
+        // read late, the symbol map may end before it
+        auto create_pgd_mapping = ki.find_symbol("create_pgd_mapping");
+        if (create_pgd_mapping == 0) {
+            throw std::runtime_error("create_pgd_mapping not found, the pgd offset is unknown");
+        }
+        return backend.mm_pgd_offset(*disasm.get(), create_pgd_mapping);
+    } };
+
+    // the modules decide what is resolved from here on
+    if (not modules_ready()) {
+        return -1;
     }
 
-    // fill runtime information
-    if (ki.runtime_info) {
-        if (ki.runtime_info->mm_pgd_required) {
-            auto create_pgd_mapping = ki.get_symbol("create_pgd_mapping");
-            
-#ifdef __aarch64__
-            ki.runtime_info->mm_pgd_offset = arm64_get_mm_pgd_offset(ki.ptr_of_sym(create_pgd_mapping));
-#else
-            BOOST_LOG_TRIVIAL(debug) << "pgd offset for current arch not available";
-            return -1;
-#endif
+    bool layout_required = all_exported or std::any_of(jobs.begin(), jobs.end(), [](const ModuleJob& job) { return job.layout_required(); });
+    bool versions_required = all_exported or std::any_of(jobs.begin(), jobs.end(), [](const ModuleJob& job) { return job.versions_required(); });
+    bool pgd_required = std::any_of(jobs.begin(), jobs.end(), [](const ModuleJob& job) { return job.pgd_required(); });
+
+    try {
+        profile.vermagic = vermagic.get();
+
+        if (layout_required) {
+            std::tie(profile.module_init_offset, profile.module_exit_offset) = module_layout.get();
+        }
+
+        if (versions_required) {
+            crcs.get();
+            profile.symbol_struct_type = ki.symbol_struct_type;
+            profile.kaslr = ki.kaslr;
+            profile.default_base = ki.default_base;
+            profile.relocated_kcrctab = ki.ARCH_RELOCATES_KCRCTAB;
+        }
+
+        // runtime information
+        if (pgd_required) {
+            profile.mm_pgd_offset = mm_pgd_offset.get();
+            profile.mm_pgd_valid = true;
         }
+
+    } catch (std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << e.what();
+        return -1;
     }
 
-    // modify module.ko
-    //   vermagic
-    //   name
-    {
-        std::string module_name = get_random_string(sizeof(RANDOM_NAME_PLACEHOLDER));
+    // kept for modules that need it later
+    if (all_exported and not profile.mm_pgd_valid and ki.find_symbol("create_pgd_mapping") != 0) {
+        try {
+            profile.mm_pgd_offset = mm_pgd_offset.get();
+            profile.mm_pgd_valid = true;
+        } catch (std::exception& e) {
+            BOOST_LOG_TRIVIAL(debug) << "profile without pgd offset: " << e.what();
+        }
+    }
 
-        auto* ptr = module_ko.data();
-        size_t size = module_ko.size();
-        while (true) {
-            ptr = reinterpret_cast<char*>(memmem(ptr, size, VERMAGIC_PLACEHOLDER, sizeof(VERMAGIC_PLACEHOLDER)));
-            if (ptr == nullptr) {
-                break;
-            }
-            memset(ptr, 0, sizeof(VERMAGIC_PLACEHOLDER));
-            memcpy(ptr, vermagic.data(), vermagic.size());
-            ptr += sizeof(VERMAGIC_PLACEHOLDER);
+    profile.identity = image_kernel_identity(ki);
+
+    return 0;
+}
+
+static CrcSource parse_crc_source(const std::string& crc)
+{
+    if (crc == "static") {
+        return CrcSource::Static;
+    } else if (crc == "emulate") {
+        return CrcSource::Emulate;
+    } else if (crc == "verify") {
+        return CrcSource::Verify;
+    }
+    throw std::invalid_argument("unknown crc source " + crc);
+}
+
+// true if the analysis would take the symbols of the running kernel from /proc/kallsyms
+static bool reads_running_kernel(const std::string& kernel, const std::string& symbol_map, bool image_symbols)
+{
+    if (not symbol_map.empty() or image_symbols) {
+        return false;
+    }
+    if (kernel.empty()) {
+        return true;
+    }
+
+    // a vmlinux with .symtab brings its own symbols, it may be any kernel
+    ElfKernel elf {};
+    return not (elf.open(UniqueFD { ::open(kernel.c_str(), O_RDONLY | O_CLOEXEC) }) and elf.has_symbols());
+}
+
+// vmlinux, bzImage, arm64 Image or a compressed payload, judged by the head of the file
+static bool is_kernel_image(const std::filesystem::path& path)
+{
+    UniqueFD fd { ::open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (not fd) {
+        return false;
+    }
+
+    std::array<char, 1024> head {};
+    auto sz = ::pread(fd.get(), head.data(), head.size(), 0);
+    if (sz <= 0) {
+        return false;
+    }
+
+    std::string_view data { head.data(), static_cast<size_t>(sz) };
+    BzImage bzimage {};
+    return (sz >= SELFMAG and memcmp(head.data(), ELFMAG, SELFMAG) == 0)
+        or parse_bzimage(data, bzimage)
+        or detect_payload(data) != PayloadFormat::Unknown;
+}
+
+/*
+    kdeploy profile-build: analyse every kernel of a directory in parallel
+    into one profile database. *.img files are boot images, other files are
+    kernel images if they look like one or have a symbol map, the rest is
+    ignored. <name>.map next to one is its symbol map, without it the
+    kallsyms tables of the image are decoded.
+*/
+static int profile_build(int argc, const char* argv[])
+{
+    std::string directory;
+    std::string output;
+    CrcSource crc_source = CrcSource::Static;
+
+    try {
+        po::options_description desc("profile-build options");
+
+        desc.add_options()("help", "show help message");
+        desc.add_options()("dir,d", po::value<std::string>(), "directory of boot images, kernel images and symbol maps");
+        desc.add_options()("output,o", po::value<std::string>()->default_value("kernels.kdb"), "profile database");
+        desc.add_options()("crc", po::value<std::string>()->default_value("static"), "crc source: static, emulate or verify");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+
+        if (not vm.count("dir")) {
+            throw std::invalid_argument("no directory");
+        }
+
+        directory = vm["dir"].as<std::string>();
+        output = vm["output"].as<std::string>();
+        crc_source = parse_crc_source(vm["crc"].as<std::string>());
+
+    } catch (std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "error: " << e.what();
+        return 1;
+    }
+
+    std::vector<std::filesystem::path> images {};
+
+    std::error_code ec {};
+    for (auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        if (not entry.is_regular_file() or entry.path().extension() == ".map") {
+            continue;
+        }
+
+        // the database of an earlier run may be in the directory
+        std::error_code same_ec {};
+        if (std::filesystem::equivalent(entry.path(), output, same_ec)) {
+            continue;
         }
 
-        ptr = module_ko.data();
-        size = module_ko.size();
-        while (true) {
-            ptr = reinterpret_cast<char*>(memmem(ptr, size, RANDOM_NAME_PLACEHOLDER, sizeof(RANDOM_NAME_PLACEHOLDER)));
-            if (ptr == nullptr) {
-                break;
+        // a symbol map next to a file makes it a kernel, even a raw one without a header
+        auto symbol_map = entry.path();
+        symbol_map.replace_extension(".map");
+
+        if (entry.path().extension() == ".img" or std::filesystem::exists(symbol_map) or is_kernel_image(entry.path())) {
+            images.push_back(entry.path());
+        } else {
+            BOOST_LOG_TRIVIAL(debug) << entry.path().string() << ": not a kernel image, ignored";
+        }
+    }
+    if (ec) {
+        BOOST_LOG_TRIVIAL(error) << "Unable read " << directory << ": " << ec.message();
+        return -1;
+    }
+
+    std::sort(images.begin(), images.end());
+
+    std::vector<KernelProfile> profiles(images.size());
+    std::vector<char> built(images.size(), 0);
+
+    // one kernel per task, each analysis spreads its own crc resolution
+    parallel_for(images.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            auto name = images[i].string();
+
+            KernelSource source {};
+            source.crc_source = crc_source;
+
+            if (images[i].extension() == ".img") {
+                source.boot_partition = name;
+            } else {
+                source.kernel = name;
+            }
+
+            auto symbol_map = images[i];
+            symbol_map.replace_extension(".map");
+            if (std::filesystem::exists(symbol_map)) {
+                source.symbol_map = symbol_map;
+            } else {
+                source.image_symbols = true;
+            }
+
+            try {
+                std::vector<ModuleJob> jobs {};
+                if (analyse_kernel(source, jobs, [] { return true; }, true, profiles[i]) != 0) {
+                    BOOST_LOG_TRIVIAL(error) << name << ": analysis failed";
+                } else if (profiles[i].identity.empty()) {
+                    BOOST_LOG_TRIVIAL(error) << name << ": kernel identity not found";
+                } else if (not profiles[i].reusable()) {
+                    // the crcs hold for a made-up kaslr offset, not for any boot
+                    BOOST_LOG_TRIVIAL(error) << name << ": kcrctab is relocated at boot, kernel left out";
+                } else {
+                    BOOST_LOG_TRIVIAL(info) << name << ": " << profiles[i].vermagic << ", " << profiles[i].symbols.size() << " symbols";
+                    built[i] = 1;
+                }
+            } catch (std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << name << ": " << e.what();
             }
-            memset(ptr, 0, sizeof(RANDOM_NAME_PLACEHOLDER));
-            memcpy(ptr, module_name.data(), module_name.size());
-            ptr += sizeof(RANDOM_NAME_PLACEHOLDER);
         }
+    });
+
+    std::vector<KernelProfile> database {};
+    for (size_t i = 0; i < profiles.size(); ++i) {
+        if (built[i]) {
+            database.push_back(std::move(profiles[i]));
+        }
+    }
+
+    if (not save_profile_database(output, database)) {
+        return -1;
+    }
+
+    BOOST_LOG_TRIVIAL(info) << output << ": " << database.size() << " of " << images.size() << " kernels";
+    return database.size() == images.size() ? 0 : -1;
+}
+
+[[gnu::weak]] int main(int argc, const char* argv[])
+{
+    if (argc > 1 and std::string_view { argv[1] } == "profile-build") {
+        return profile_build(argc - 1, argv + 1);
     }
 
-    // write file
-    {
-        int out_fd = ::open(output_file.c_str(), O_WRONLY | O_CREAT, 0644);
-        if (out_fd == -1) {
-            BOOST_LOG_TRIVIAL(debug) << "Unable write file";
+    std::vector<std::string> module_files;
+    std::vector<std::string> output_files;
+    std::string boot_partition;
+    std::string kernel;
+    std::string symbol_map;
+    std::string profile_cache;
+    std::string profile_database;
+    std::string serve_socket;
+    std::string client_socket;
+    bool load = false;
+    bool all_symbols = false;
+    bool image_symbols = false;
+    bool live = false;
+    CrcSource crc_source = CrcSource::Static;
+
+    try {
+        po::options_description desc("Allowed options");
+
+        desc.add_options()("help", "show help message");
+        desc.add_options()("module,m", po::value<std::vector<std::string>>()->multitoken(), "module files");
+        desc.add_options()("boot,b", po::value<std::string>(), "boot partition");
+        desc.add_options()("kernel,k", po::value<std::string>(), "kernel image, raw or compressed Image, bzImage or vmlinux");
+        desc.add_options()("symbol-map,s", po::value<std::string>(), "symbol map");
+        desc.add_options()("all-symbols", "keep every symbol of the symbol map");
+        desc.add_options()("image-symbols", "decode the kallsyms tables of the kernel image instead of reading a symbol map");
+        desc.add_options()("live", "read the running kernel through /proc/kcore instead of a kernel image");
+        desc.add_options()("crc", po::value<std::string>()->default_value("static"), "crc source: static, emulate or verify");
+        desc.add_options()("output,o", po::value<std::vector<std::string>>()->multitoken(), "output files, one per module, out.ko for a single module");
+        desc.add_options()("profile-cache", po::value<std::string>(), "kernel profile cache directory");
+        desc.add_options()("profile-db", po::value<std::string>(), "kernel profile database made by profile-build");
+        desc.add_options()("serve", po::value<std::string>(), "keep the analysis and patch the modules sent to this unix socket");
+        desc.add_options()("client", po::value<std::string>(), "patch the modules through the kdeploy serving this unix socket");
+        desc.add_options()("load", "load the patched modules, they are written only if outputs are given");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+
+        if (vm.count("module")) {
+            module_files = vm["module"].as<std::vector<std::string>>();
+        }
+
+        if (vm.count("boot")) {
+            boot_partition = vm["boot"].as<std::string>();
+        }
+
+        if (vm.count("kernel")) {
+            kernel = vm["kernel"].as<std::string>();
+        }
+
+        if (vm.count("symbol-map")) {
+            symbol_map = vm["symbol-map"].as<std::string>();
+        }
+
+        all_symbols = vm.count("all-symbols") != 0;
+        image_symbols = vm.count("image-symbols") != 0;
+        live = vm.count("live") != 0;
+
+        crc_source = parse_crc_source(vm["crc"].as<std::string>());
+
+        if (vm.count("profile-cache")) {
+            profile_cache = vm["profile-cache"].as<std::string>();
+        }
+
+        if (vm.count("profile-db")) {
+            profile_database = vm["profile-db"].as<std::string>();
+        }
+
+        if (vm.count("serve")) {
+            serve_socket = vm["serve"].as<std::string>();
+        }
+
+        if (vm.count("client")) {
+            client_socket = vm["client"].as<std::string>();
+        }
+
+        load = vm.count("load") != 0;
+
+        if (vm.count("output")) {
+            output_files = vm["output"].as<std::vector<std::string>>();
+        } else if (module_files.size() == 1 and not load) {
+            output_files.push_back("out.ko");
+        }
+
+        if (module_files.empty() and serve_socket.empty()) {
+            throw std::invalid_argument("no module file");
+        }
+        if (not serve_socket.empty() and not client_socket.empty()) {
+            throw std::invalid_argument("--serve and --client are exclusive");
+        }
+        if (live and (not kernel.empty() or not boot_partition.empty() or not symbol_map.empty() or image_symbols)) {
+            throw std::invalid_argument("--live reads the image and the symbols of the running kernel");
+        }
+        if (live and crc_source != CrcSource::Static) {
+            throw std::invalid_argument("--live reads the kcrctab, it can not emulate");
+        }
+        if ((not load or not output_files.empty()) and output_files.size() != module_files.size()) {
+            throw std::invalid_argument("one output file per module is required");
+        }
+
+    } catch (std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "error: " << e.what();
+        return 1;
+    }
+
+    // read the modules and find their sections, alongside whatever runs until they are needed
+    std::vector<ModuleJob> jobs(module_files.size());
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].input = module_files[i];
+        if (i < output_files.size()) {
+            jobs[i].output = output_files[i];
+        }
+    }
+
+    auto read_modules = std::async(std::launch::async, [&jobs]() {
+        parallel_for(jobs.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                jobs[i].ko = read_file(jobs[i].input);
+                if (not jobs[i].ko.empty()) {
+                    jobs[i].sections = find_module_sections(jobs[i].ko);
+                }
+            }
+        });
+
+        for (auto& job : jobs) {
+            if (job.ko.empty()) {
+                BOOST_LOG_TRIVIAL(error) << "Empty file " << job.input;
+                return false;
+            }
+
+            BOOST_LOG_TRIVIAL(debug) << "module " << job.input << " size " << job.ko.size();
+
+            // without init and exit the module has no this_module relocations
+            if (job.sections.this_module.data == nullptr) {
+                BOOST_LOG_TRIVIAL(debug) << ".gnu.linkonce.this_module not found in " << job.input;
+                return false;
+            }
+        }
+        return true;
+    });
+
+    std::optional<bool> modules_read {};
+    auto modules_ready = [&]() {
+        if (not modules_read) {
+            modules_read = read_modules.get();
+        }
+        return *modules_read;
+    };
+
+    // patched by a resident kdeploy, nothing is analysed here
+    if (not client_socket.empty()) {
+        if (not modules_ready()) {
             return -1;
         }
-        if (::write(out_fd, module_ko.data(), module_ko.size()) != module_ko.size()) {
-            BOOST_LOG_TRIVIAL(debug) << "Disk out of space";
-            ::close(out_fd);
+        for (auto& job : jobs) {
+            std::vector<char> reply {};
+            auto status = serve_request(client_socket, load ? ServeOp::Load : ServeOp::Patch, job.ko, reply);
+            if (status != 0) {
+                BOOST_LOG_TRIVIAL(error) << job.input << ": " << std::string_view { reply.data(), reply.size() };
+                return -1;
+            }
+
+            if (load) {
+                BOOST_LOG_TRIVIAL(info) << job.input << " loaded";
+            } else if (write_module(reply, job.output) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // patch the batch, then keep serving if asked to
+    auto finish = [&](const KernelProfile& profile) {
+        if (patch_modules(profile, jobs, load) != 0) {
             return -1;
         }
-        ::close(out_fd);
+        if (not serve_socket.empty()) {
+            return serve(profile, serve_socket);
+        }
+        return 0;
+    };
+
+    // a profile of the running kernel replaces the analysis, the boot partition is not read
+    if ((not profile_cache.empty() or not profile_database.empty()) and reads_running_kernel(kernel, symbol_map, image_symbols)) {
+        auto identity = running_kernel_identity();
+
+        KernelProfile profile {};
+        std::string profile_file {};
+        if (identity.empty()) {
+            BOOST_LOG_TRIVIAL(debug) << "identity of the running kernel not found";
+        } else if (not profile_database.empty() and load_profile_database(profile_database, identity, profile)) {
+            profile_file = profile_database;
+        } else if (not profile_cache.empty() and profile.load(profile_cache + "/" + identity.file_name())) {
+            profile_file = profile_cache + "/" + identity.file_name();
+        }
+
+        if (not profile_file.empty()) {
+            if (not modules_ready()) {
+                return -1;
+            }
+            if (not (profile.identity == identity)) {
+                BOOST_LOG_TRIVIAL(warning) << "kernel profile of another kernel " << profile_file;
+            } else if (std::all_of(jobs.begin(), jobs.end(), [&](const ModuleJob& job) { return profile_covers(profile, job); })) {
+                BOOST_LOG_TRIVIAL(info) << "kernel profile " << profile_file;
+                BOOST_LOG_TRIVIAL(info) << "vermagic: " << profile.vermagic;
+                return finish(profile);
+            }
+        }
     }
 
-    BOOST_LOG_TRIVIAL(debug) << "!! done !!";
-    return 0;
+    KernelSource source { kernel, boot_partition, symbol_map, all_symbols, image_symbols, live, crc_source };
+
+    // the analysis result every module is patched from, complete if it outlives this run
+    bool all_exported = not profile_cache.empty() or not serve_socket.empty();
+
+    KernelProfile profile {};
+    auto status = analyse_kernel(source, jobs, modules_ready, all_exported, profile);
+    if (status != 0) {
+        return status;
+    }
+
+    if (not profile_cache.empty()) {
+        if (profile.identity.empty()) {
+            BOOST_LOG_TRIVIAL(warning) << "kernel identity not found, profile not saved";
+        } else {
+            std::error_code ec {};
+            std::filesystem::create_directories(profile_cache, ec);
+
+            auto profile_file = profile_cache + "/" + profile.identity.file_name();
+            if (profile.save(profile_file)) {
+                BOOST_LOG_TRIVIAL(info) << "kernel profile " << profile_file << ", " << profile.symbols.size() << " symbols";
+            }
+        }
+    }
+
+    return finish(profile);
 }
@@ -17,13 +17,18 @@
 #ifndef __kdeploy_h__
 #define __kdeploy_h__
 
+#include <functional>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 
 #include "kagent/common.h"
 
+#include "buffer.h"
+#include "kallsyms.h"
+
 using namespace std::string_literals;
 
 enum class KernelSymbolStructType {
@@ -34,16 +39,24 @@ enum class KernelSymbolStructType {
     V4,
 };
 
+// the architecture of the analysed kernel, not of the host
+enum class KernelArch {
+    Arm64,
+    X86_64,
+};
+
 struct KernelInformation {
     // boot partition/kernel-image buffer
-    std::vector<char> buffer {};
+    ImageBuffer buffer {};
+
+    KernelArch arch { KernelArch::Arm64 };
 
     uintptr_t load_offset { 0 };
     uintptr_t load_size { 0 };
 
     uintptr_t default_base { 0 };
 
-    std::unordered_map<std::string, uintptr_t> kallsyms;
+    SymbolIndex kallsyms;
 
     uintptr_t sym_text { 0 };
     uintptr_t sym_delete_modulem { 0 };
@@ -62,11 +75,15 @@ struct KernelInformation {
     bool ARCH_RELOCATES_KCRCTAB { false };
     uintptr_t kaslr { 0 };
 
-    RuntimeInformation* runtime_info{nullptr};
+    // relocates [offset, offset + size) of the buffer on first use, set by a lazy relocation
+    std::function<void(size_t offset, size_t size)> relocate {};
 
     template <typename T = uint8_t*>
-    T ptr_of_sym(uintptr_t addr)
+    T ptr_of_sym(uintptr_t addr, size_t size = 1)
     {
+        if (relocate) {
+            relocate(addr - sym_text, size);
+        }
         return reinterpret_cast<T>(buffer.data() + (addr - sym_text));
     }
 
@@ -75,8 +92,11 @@ struct KernelInformation {
     }
 
     template <typename T = uint8_t*>
-    T ptr(uintptr_t offset)
+    T ptr(uintptr_t offset, size_t size = 1)
     {
+        if (relocate) {
+            relocate(offset, size);
+        }
         return reinterpret_cast<T>(buffer.data() + offset);
     }
 
@@ -107,20 +127,20 @@ struct KernelInformation {
         return self == target;
     }
 
-    uintptr_t get_symbol(const std::string& name) {
-        auto iter = kallsyms.find(name);
-        if (iter == kallsyms.end()) {
-            throw std::invalid_argument("symbol not found: "s + name);
+    uintptr_t get_symbol(std::string_view name) {
+        auto* symbol = kallsyms.find(name);
+        if (symbol == nullptr) {
+            throw std::invalid_argument("symbol not found: "s + std::string(name));
         }
-        return iter->second;
+        return symbol->address;
     }
 
-    uintptr_t find_symbol(const std::string& name, uintptr_t default_value=0) {
-        auto iter = kallsyms.find(name);
-        if (iter == kallsyms.end()) {
+    uintptr_t find_symbol(std::string_view name, uintptr_t default_value=0) {
+        auto* symbol = kallsyms.find(name);
+        if (symbol == nullptr) {
             return default_value;
         }
-        return iter->second;
+        return symbol->address;
     }
 };
 
@@ -134,6 +154,7 @@ struct SymbolTable {
     void* symbol_stop_ptr;
     void* crc_start_ptr;
     void* crc_stop_ptr;
+    size_t crc_size; // unsigned long before 4.11, u32 after
 };
 
 enum class KernelSymbolMethod {
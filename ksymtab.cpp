@@ -0,0 +1,152 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#include <boost/log/trivial.hpp>
+
+#include "ksymtab.h"
+
+constexpr size_t min_table_size = 16;
+
+namespace {
+
+struct NameRange {
+    const char* begin;
+    const char* end;
+};
+
+}
+
+// the name, or nullptr if it points outside the image, e.g. an unrelocated absolute pointer
+static const char* checked_name(const char* name, const NameRange& range)
+{
+    if (name < range.begin or name >= range.end) {
+        return nullptr;
+    }
+    return name;
+}
+
+template <typename S>
+static typename std::enable_if<S::method == KernelSymbolMethod::Offset, const char*>::type
+name_of(const S* symbol, const NameRange& range)
+{
+    return checked_name(reinterpret_cast<const char*>(&symbol->name_offset) + symbol->name_offset, range);
+}
+
+template <typename S>
+static typename std::enable_if<S::method == KernelSymbolMethod::Abs, const char*>::type
+name_of(const S* symbol, const NameRange& range)
+{
+    return checked_name(symbol->name, range);
+}
+
+template <typename S>
+static void collect(std::vector<KsymtabIndex::Entry>& entries, const SymbolTable& table, uint32_t table_index, const NameRange& range)
+{
+    auto* begin = reinterpret_cast<const S*>(table.symbol_start_ptr);
+    auto* end = reinterpret_cast<const S*>(table.symbol_stop_ptr);
+
+    size_t skipped = 0;
+    for (auto* iter = begin; iter < end; ++iter) {
+        auto* name = name_of(iter, range);
+        auto* nul = name == nullptr ? nullptr : static_cast<const char*>(memchr(name, '\0', range.end - name));
+        if (nul == nullptr) {
+            ++skipped;
+            continue;
+        }
+        entries.push_back({ name, static_cast<uint32_t>(nul - name), table_index, static_cast<uint32_t>(iter - begin) });
+    }
+
+    if (skipped != 0) {
+        BOOST_LOG_TRIVIAL(debug) << table.name << " " << skipped << " symbols without name";
+    }
+}
+
+void KsymtabIndex::build(KernelInformation& ki, const std::vector<SymbolTable>& tables)
+{
+    NameRange range { ki.buffer.data(), ki.buffer.data() + ki.buffer.size() };
+
+    _entries.clear();
+
+    for (uint32_t i = 0; i < tables.size(); ++i) {
+        auto& table = tables[i];
+        switch (ki.symbol_struct_type) {
+        case KernelSymbolStructType::V1:
+            collect<KernelSymbol1>(_entries, table, i, range);
+            break;
+        case KernelSymbolStructType::V2:
+            collect<KernelSymbol2>(_entries, table, i, range);
+            break;
+        case KernelSymbolStructType::V3:
+            collect<KernelSymbol3>(_entries, table, i, range);
+            break;
+        case KernelSymbolStructType::V4:
+            collect<KernelSymbol4>(_entries, table, i, range);
+            break;
+        default:
+            throw std::runtime_error("unsupported kernel symbol type");
+        }
+    }
+
+    size_t capacity = min_table_size;
+    while (capacity < _entries.size() * 2) {
+        capacity *= 2;
+    }
+
+    _table.assign(capacity, 0);
+    for (uint32_t i = 0; i < _entries.size(); ++i) {
+        insert(i);
+    }
+}
+
+void KsymtabIndex::insert(uint32_t index)
+{
+    std::string_view name { _entries[index].name, _entries[index].size };
+    size_t mask = _table.size() - 1;
+    size_t slot = std::hash<std::string_view> {}(name) & mask;
+
+    while (_table[slot] != 0) {
+        auto& entry = _entries[_table[slot] - 1];
+        // keep the entry of the first table
+        if (std::string_view { entry.name, entry.size } == name) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    _table[slot] = index + 1;
+}
+
+const KsymtabIndex::Entry* KsymtabIndex::find(std::string_view name) const
+{
+    if (_table.empty()) {
+        return nullptr;
+    }
+
+    size_t mask = _table.size() - 1;
+    size_t slot = std::hash<std::string_view> {}(name) & mask;
+
+    while (_table[slot] != 0) {
+        auto& entry = _entries[_table[slot] - 1];
+        if (std::string_view { entry.name, entry.size } == name) {
+            return &entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return nullptr;
+}
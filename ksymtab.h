@@ -0,0 +1,58 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __ksymtab_h__
+#define __ksymtab_h__
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "kdeploy.h"
+
+/*
+    Name index over the exported symbol tables.
+
+    The entries of every table are decoded once, lookup is an open
+    addressing table keyed by name. For a name exported by more than one
+    table the first table wins, like the linear scan it replaces.
+*/
+class KsymtabIndex {
+public:
+    struct Entry {
+        const char* name;
+        uint32_t size;
+        uint32_t table; // index in the SymbolTable list
+        uint32_t index; // index in the table
+    };
+
+private:
+    std::vector<Entry> _entries {};
+    std::vector<uint32_t> _table {}; // entry index + 1, 0 for empty slots
+
+    void insert(uint32_t index);
+
+public:
+    void build(KernelInformation& ki, const std::vector<SymbolTable>& tables);
+
+    const Entry* find(std::string_view name) const;
+
+    const std::vector<Entry>& entries() const { return _entries; }
+
+    size_t size() const { return _entries.size(); }
+};
+
+#endif
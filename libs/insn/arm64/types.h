@@ -1,8 +1,16 @@
+#ifndef __INSN_TYPES_H
+#define __INSN_TYPES_H
+
 
 #include <stdint.h>
 #include <errno.h>
 
+#ifdef INSN_HOST
+// host tools, nothing to log to
+#define pr_err(...) ((void)0)
+#else
 #include "kapi.h"
+#endif
 
 #ifdef __ASSEMBLY__
 #define _AC(X,Y)        X
@@ -80,6 +88,45 @@ typedef int64_t s64;
 #define __always_inline
 #endif
 
+#ifndef __cplusplus
 #define bool _Bool
 #define false 0
 #define true 1
+#endif
+
+// linux/bits.h, linux/align.h, linux/bitops.h, asm/bug.h
+
+#define GENMASK(h, l) \
+    (((~UL(0)) - (UL(1) << (l)) + 1) & (~UL(0) >> (sizeof(long) * 8 - 1 - (h))))
+
+#define ALIGN_DOWN(x, a) ((x) & ~((a) - 1))
+
+#define BUG() __builtin_trap()
+#define BUG_ON(condition) \
+    do {                  \
+        if (condition)    \
+            BUG();        \
+    } while (0)
+
+#define ffs(x) __builtin_ffs(x)
+
+static inline unsigned long __ffs64(u64 word)
+{
+    return __builtin_ctzll(word);
+}
+
+static inline int fls64(u64 x)
+{
+    return x == 0 ? 0 : 64 - __builtin_clzll(x);
+}
+
+// lib/hweight.c, no libgcc call
+static inline unsigned int hweight64(u64 w)
+{
+    w -= (w >> 1) & 0x5555555555555555ull;
+    w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (w * 0x0101010101010101ull) >> 56;
+}
+
+#endif
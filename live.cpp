@@ -0,0 +1,237 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include <boost/log/trivial.hpp>
+
+#include "live.h"
+
+// what the analysis may read past a symbol, as analysis_extent assumes
+constexpr size_t function_window = 0x1000;
+constexpr size_t string_window = 1024;
+
+bool Kcore::open(const std::string& path)
+{
+    _fd = UniqueFD { ::open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (not _fd) {
+        return false;
+    }
+
+    ElfW(Ehdr) header {};
+    if (::pread(_fd.get(), &header, sizeof(header), 0) != sizeof(header)
+        or memcmp(header.e_ident, ELFMAG, SELFMAG) != 0
+        or header.e_phentsize != sizeof(ElfW(Phdr))) {
+        return false;
+    }
+
+    std::vector<ElfW(Phdr)> phdrs(header.e_phnum);
+    auto size = phdrs.size() * sizeof(ElfW(Phdr));
+    if (::pread(_fd.get(), phdrs.data(), size, header.e_phoff) != static_cast<ssize_t>(size)) {
+        return false;
+    }
+
+    for (auto& phdr : phdrs) {
+        if (phdr.p_type == PT_LOAD) {
+            _loads.push_back(phdr);
+        }
+        if (phdr.p_type == PT_NOTE) {
+            _notes.push_back(phdr);
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "kcore " << _loads.size() << " segments";
+
+    return not _loads.empty();
+}
+
+bool Kcore::read(uintptr_t addr, void* buffer, size_t size) const
+{
+    auto* out = static_cast<char*>(buffer);
+
+    while (size != 0) {
+        auto load = std::find_if(_loads.begin(), _loads.end(), [&](const ElfW(Phdr)& phdr) {
+            return addr >= phdr.p_vaddr and addr - phdr.p_vaddr < phdr.p_memsz;
+        });
+        if (load == _loads.end()) {
+            return false;
+        }
+
+        // a range may span adjacent segments
+        size_t chunk = std::min<size_t>(size, load->p_vaddr + load->p_memsz - addr);
+        if (::pread(_fd.get(), out, chunk, load->p_offset + (addr - load->p_vaddr)) != static_cast<ssize_t>(chunk)) {
+            return false;
+        }
+
+        out += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+std::optional<uintptr_t> Kcore::kernel_offset() const
+{
+    constexpr std::string_view key = "KERNELOFFSET=";
+
+    for (auto& phdr : _notes) {
+        std::vector<char> notes(phdr.p_filesz);
+        if (::pread(_fd.get(), notes.data(), notes.size(), phdr.p_offset) != static_cast<ssize_t>(notes.size())) {
+            continue;
+        }
+
+        size_t offset = 0;
+        while (offset + sizeof(ElfW(Nhdr)) <= notes.size()) {
+            ElfW(Nhdr) note {};
+            memcpy(&note, notes.data() + offset, sizeof(note));
+            offset += sizeof(note);
+
+            auto name_size = (note.n_namesz + 3) & ~3u;
+            auto desc_size = (note.n_descsz + 3) & ~3u;
+            if (name_size > notes.size() - offset or desc_size > notes.size() - offset - name_size) {
+                break;
+            }
+
+            std::string_view name { notes.data() + offset, strnlen(notes.data() + offset, note.n_namesz) };
+            std::string_view desc { notes.data() + offset + name_size, note.n_descsz };
+            offset += name_size + desc_size;
+
+            if (name != "VMCOREINFO") {
+                continue;
+            }
+
+            auto pos = desc.find(key);
+            if (pos != std::string_view::npos) {
+                return std::strtoull(std::string { desc.substr(pos + key.size(), 32) }.c_str(), nullptr, 16);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+void read_live_image(KernelInformation& ki, const Kcore& kcore)
+{
+    // the tables, their names and the rest of the analysis sit before the end of rodata
+    auto end_rodata = ki.get_symbol("__end_rodata");
+    if (end_rodata <= ki.sym_text) {
+        throw std::runtime_error("invalid __end_rodata");
+    }
+
+    size_t extent = end_rodata - ki.sym_text;
+    for (auto addr : { ki.sym_delete_modulem, ki.sym_module_get_kallsym, ki.find_symbol("create_pgd_mapping") }) {
+        if (addr != 0) {
+            extent = std::max<size_t>(extent, addr + function_window - ki.sym_text);
+        }
+    }
+
+    // zero pages until read
+    ki.buffer.resize(extent);
+
+    size_t bytes = 0;
+    size_t ranges = 0;
+
+    auto fetch = [&](uintptr_t addr, size_t size) {
+        if (addr < ki.sym_text or addr - ki.sym_text >= extent) {
+            return;
+        }
+        size = std::min(size, extent - (addr - ki.sym_text));
+        if (not kcore.read(addr, ki.buffer.data() + (addr - ki.sym_text), size)) {
+            throw std::runtime_error("Unable read kernel memory at "s + std::to_string(addr));
+        }
+        bytes += size;
+        ++ranges;
+    };
+
+    auto fetch_range = [&](const char* start, const char* stop) {
+        auto begin = ki.find_symbol(start);
+        auto end = ki.find_symbol(stop);
+        if (begin != 0 and end > begin) {
+            fetch(begin, end - begin);
+        }
+    };
+
+    // image header
+    fetch(ki.sym_text, 64);
+
+    for (auto addr : { ki.sym_delete_modulem, ki.sym_module_get_kallsym, ki.find_symbol("create_pgd_mapping") }) {
+        if (addr != 0) {
+            fetch(addr, function_window);
+        }
+    }
+
+    fetch(ki.sym_vermagic, string_window);
+
+    // kernel identity
+    fetch_range("__start_notes", "__stop_notes");
+    if (auto banner = ki.find_symbol("linux_banner")) {
+        fetch(banner, string_window);
+    }
+
+    // symbol tables, __ksymtab_strings follows the last of them
+    uintptr_t tables_end = 0;
+    for (auto* table : { "___ksymtab", "___ksymtab_gpl", "___ksymtab_gpl_future",
+             "___kcrctab", "___kcrctab_gpl", "___kcrctab_gpl_future" }) {
+        auto start = "__start"s + table;
+        auto stop = "__stop"s + table;
+        fetch_range(start.c_str(), stop.c_str());
+        tables_end = std::max(tables_end, ki.find_symbol(stop));
+    }
+
+    if (tables_end != 0 and tables_end < end_rodata) {
+        fetch(tables_end, end_rodata - tables_end);
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "kcore: " << bytes << " bytes in " << ranges << " reads";
+}
+
+void rebase_live_names(KernelInformation& ki, const std::vector<SymbolTable>& tables)
+{
+    size_t stride = 0;
+    switch (ki.symbol_struct_type) {
+    case KernelSymbolStructType::V1:
+        stride = sizeof(KernelSymbol1);
+        break;
+    case KernelSymbolStructType::V4:
+        stride = sizeof(KernelSymbol4);
+        break;
+    default:
+        // relative names need no rebase
+        return;
+    }
+
+    // value, name[, namespace]
+    constexpr size_t name_offset = sizeof(unsigned long);
+
+    auto* base = ki.buffer.data();
+    for (auto& table : tables) {
+        auto* begin = static_cast<char*>(table.symbol_start_ptr);
+        auto* end = static_cast<char*>(table.symbol_stop_ptr);
+        for (auto* entry = begin; entry + stride <= end; entry += stride) {
+            uintptr_t name { 0 };
+            memcpy(&name, entry + name_offset, sizeof(name));
+            if (name >= ki.sym_text and name - ki.sym_text < ki.buffer.size()) {
+                name = reinterpret_cast<uintptr_t>(base + (name - ki.sym_text));
+                memcpy(entry + name_offset, &name, sizeof(name));
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __live_h__
+#define __live_h__
+
+#include <link.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "kdeploy.h"
+#include "utils.h"
+
+/*
+    Memory of the running kernel through /proc/kcore.
+
+    The PT_LOAD program headers map kernel virtual addresses to file
+    offsets, reads are plain preads. Needs CAP_SYS_RAWIO.
+*/
+class Kcore {
+    UniqueFD _fd {};
+    std::vector<ElfW(Phdr)> _loads {};
+    std::vector<ElfW(Phdr)> _notes {};
+
+public:
+    bool open(const std::string& path = "/proc/kcore");
+
+    // false if a byte of [addr, addr + size) is not mapped
+    bool read(uintptr_t addr, void* buffer, size_t size) const;
+
+    // KERNELOFFSET of the vmcoreinfo note, 4.19 and later
+    std::optional<uintptr_t> kernel_offset() const;
+};
+
+/*
+    Fill ki.buffer with the parts of the running kernel the analysis reads:
+    the image header, the disassembled functions, vermagic, the kernel
+    identity, the symbol tables and their names. ki.kallsyms holds the
+    running kernel's symbols, the rest of the buffer stays zero.
+*/
+void read_live_image(KernelInformation& ki, const Kcore& kcore);
+
+// point the absolute names of V1 and V4 tables into ki.buffer instead of kernel memory
+void rebase_live_names(KernelInformation& ki, const std::vector<SymbolTable>& tables);
+
+#endif
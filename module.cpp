@@ -0,0 +1,257 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include <boost/log/trivial.hpp>
+
+#include "module.h"
+#include "utils.h"
+
+ModuleView::ModuleView(std::vector<char>& module_ko)
+{
+    auto size = module_ko.size();
+    if (size < sizeof(ElfW(Ehdr)) or memcmp(module_ko.data(), ELFMAG, SELFMAG) != 0) {
+        return;
+    }
+
+    auto* header = reinterpret_cast<ElfW(Ehdr)*>(module_ko.data());
+    if (header->e_shoff > size or header->e_shnum > (size - header->e_shoff) / sizeof(ElfW(Shdr))
+        or header->e_shstrndx >= header->e_shnum) {
+        return;
+    }
+
+    auto* shdr = reinterpret_cast<ElfW(Shdr)*>(module_ko.data() + header->e_shoff);
+
+    auto in_file = [&](const ElfW(Shdr)& section) {
+        return section.sh_offset <= size and section.sh_size <= size - section.sh_offset;
+    };
+
+    auto& strtab_section = shdr[header->e_shstrndx];
+    if (not in_file(strtab_section)) {
+        return;
+    }
+    auto* shstrtab = module_ko.data() + strtab_section.sh_offset;
+
+    _sections.reserve(header->e_shnum);
+    for (int i = 0; i < header->e_shnum; ++i) {
+        // NOBITS have no content in the file
+        if (shdr[i].sh_name >= strtab_section.sh_size or shdr[i].sh_type == SHT_NOBITS or not in_file(shdr[i])) {
+            continue;
+        }
+
+        std::string_view name { shstrtab + shdr[i].sh_name, strnlen(shstrtab + shdr[i].sh_name, strtab_section.sh_size - shdr[i].sh_name) };
+        _sections.emplace(name, Section { module_ko.data() + shdr[i].sh_offset, shdr[i].sh_size });
+    }
+}
+
+ModuleSections find_module_sections(std::vector<char>& module_ko)
+{
+    ModuleView view { module_ko };
+    ModuleSections sections {};
+
+    sections.this_module_rela = view.section<ElfW(Rela)>(".rela.gnu.linkonce.this_module", sections.rela_num);
+    sections.versions = view.section<SymbolVersion>("__versions", sections.vers_num);
+
+    size_t count = 0;
+    sections.runtime_info = view.section<RuntimeInformation>(".kagent.runtime.information", count);
+
+    sections.modinfo = view.section(".modinfo");
+    sections.this_module = view.section(".gnu.linkonce.this_module");
+
+    return sections;
+}
+
+void relocate_this_module(ModuleSections& sections, uintptr_t module_init_offset, uintptr_t module_exit_offset)
+{
+    auto* this_module_rela = sections.this_module_rela;
+
+    for (int i = 0; i < sections.rela_num; ++i) {
+        BOOST_LOG_TRIVIAL(debug) << "this_module rela " << i << " " << this_module_rela[i].r_offset;
+        if (this_module_rela[i].r_offset == offsetof(KernelModule, init)) {
+            this_module_rela[i].r_offset = module_init_offset;
+        }
+        if (this_module_rela[i].r_offset == offsetof(KernelModule, exit)) {
+            this_module_rela[i].r_offset = module_exit_offset;
+        }
+    }
+}
+
+bool ModuleJob::layout_required() const
+{
+    for (size_t i = 0; i < sections.rela_num; ++i) {
+        auto offset = sections.this_module_rela[i].r_offset;
+        if (offset == offsetof(KernelModule, init) or offset == offsetof(KernelModule, exit)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool profile_covers(const KernelProfile& profile, const ModuleJob& job)
+{
+    if (job.pgd_required() and not profile.mm_pgd_valid) {
+        BOOST_LOG_TRIVIAL(debug) << "kernel profile without pgd offset for " << job.input;
+        return false;
+    }
+    return true;
+}
+
+void patch_module(const KernelProfile& profile, ModuleJob& job)
+{
+    auto& sections = job.sections;
+
+    relocate_this_module(sections, profile.module_init_offset, profile.module_exit_offset);
+
+    size_t missing = 0;
+    for (size_t i = 0; i < sections.vers_num; ++i) {
+        auto& version = sections.versions[i];
+        auto* crc = profile.find_crc({ version.name, strnlen(version.name, sizeof(version.name)) });
+        if (crc != nullptr) {
+            version.crc = *crc;
+            BOOST_LOG_TRIVIAL(info) << "crc " << (void*)(uintptr_t)version.crc << " " << version.name;
+        } else {
+            BOOST_LOG_TRIVIAL(error) << "NOT FOUND " << version.name << " in " << job.input;
+            ++missing;
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << job.input << ": resolved " << sections.vers_num - missing << "/" << sections.vers_num << " symbol versions";
+
+    if (job.pgd_required()) {
+        sections.runtime_info->mm_pgd_offset = profile.mm_pgd_offset;
+    }
+}
+
+void fill_placeholders(ModuleSections& sections, const std::string& vermagic)
+{
+    std::string module_name = get_random_string(sizeof(RANDOM_NAME_PLACEHOLDER));
+
+    struct Placeholder {
+        std::string_view pattern;
+        const std::string& value;
+    };
+
+    // with the terminating null, the value is padded with nulls
+    const Placeholder placeholders[] {
+        { { VERMAGIC_PLACEHOLDER, sizeof(VERMAGIC_PLACEHOLDER) }, vermagic },
+        { { RANDOM_NAME_PLACEHOLDER, sizeof(RANDOM_NAME_PLACEHOLDER) }, module_name },
+    };
+
+    // one pass over each section for all the placeholders
+    for (auto& section : { sections.modinfo, sections.this_module }) {
+        std::string_view data { section.data, section.size };
+        size_t offset = 0;
+        while (offset < data.size()) {
+            auto* placeholder = std::find_if(std::begin(placeholders), std::end(placeholders), [&](const Placeholder& p) {
+                return data.compare(offset, p.pattern.size(), p.pattern) == 0;
+            });
+            if (placeholder == std::end(placeholders)) {
+                ++offset;
+                continue;
+            }
+
+            auto* ptr = section.data + offset;
+            memset(ptr, 0, placeholder->pattern.size());
+            memcpy(ptr, placeholder->value.data(), std::min(placeholder->value.size(), placeholder->pattern.size() - 1));
+            offset += placeholder->pattern.size();
+        }
+    }
+}
+
+int write_module(const std::vector<char>& module_ko, const std::string& output_file)
+{
+    int out_fd = ::open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        BOOST_LOG_TRIVIAL(debug) << "Unable write file";
+        return -1;
+    }
+    if (::write(out_fd, module_ko.data(), module_ko.size()) != module_ko.size()) {
+        BOOST_LOG_TRIVIAL(debug) << "Disk out of space";
+        ::close(out_fd);
+        return -1;
+    }
+    ::close(out_fd);
+
+    BOOST_LOG_TRIVIAL(debug) << output_file << " done";
+    return 0;
+}
+
+int patch_modules(const KernelProfile& profile, std::vector<ModuleJob>& jobs, bool load)
+{
+    std::atomic<size_t> failed { 0 };
+
+    parallel_for(jobs.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            patch_module(profile, jobs[i]);
+            fill_placeholders(jobs[i].sections, profile.vermagic);
+            if (jobs[i].output.empty()) {
+                continue;
+            }
+            if (write_module(jobs[i].ko, jobs[i].output) != 0) {
+                BOOST_LOG_TRIVIAL(error) << "Unable write " << jobs[i].output;
+                ++failed;
+            }
+        }
+    });
+
+    if (failed != 0) {
+        return -1;
+    }
+
+    // in order, a module may use the symbols of one loaded before it
+    for (size_t i = 0; load and i < jobs.size(); ++i) {
+        auto error = load_module(jobs[i].ko);
+        if (error != 0) {
+            BOOST_LOG_TRIVIAL(error) << "Unable load " << jobs[i].input << ": " << strerror(error)
+                                     << (error == ENOEXEC or error == EINVAL ? ", see dmesg" : "");
+            return -1;
+        }
+        BOOST_LOG_TRIVIAL(info) << jobs[i].input << " loaded";
+    }
+
+    return 0;
+}
+
+int load_module(const std::vector<char>& module_ko)
+{
+    // finit_module wants a file, a memfd holds the module without touching the disk.
+    // without memfd, kernels before 3.17, the module goes to init_module
+    auto fd = create_memfd("kdeploy-module");
+    if (fd and ::write(fd.get(), module_ko.data(), module_ko.size()) == static_cast<ssize_t>(module_ko.size())) {
+        if (::syscall(SYS_finit_module, fd.get(), "", 0) == 0) {
+            return 0;
+        }
+
+        // kernels before 3.8, or a policy that only denies loading from a file
+        if (errno != ENOSYS and errno != EACCES) {
+            return errno;
+        }
+        BOOST_LOG_TRIVIAL(debug) << "finit_module: " << strerror(errno) << ", trying init_module";
+    }
+
+    if (::syscall(SYS_init_module, module_ko.data(), module_ko.size(), "") != 0) {
+        return errno;
+    }
+    return 0;
+}
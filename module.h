@@ -0,0 +1,114 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __module_h__
+#define __module_h__
+
+#include <link.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "kagent/private.h"
+
+#include "profile.h"
+
+// the section headers of a module, indexed by name once
+class ModuleView {
+public:
+    struct Section {
+        char* data { nullptr };
+        size_t size { 0 };
+    };
+
+private:
+    std::unordered_map<std::string_view, Section> _sections {};
+
+public:
+    // sections out of the file are left out, none if it is not an ELF file
+    explicit ModuleView(std::vector<char>& module_ko);
+
+    // empty if absent
+    Section section(std::string_view name) const
+    {
+        auto iter = _sections.find(name);
+        return iter == _sections.end() ? Section {} : iter->second;
+    }
+
+    template <typename T>
+    T* section(std::string_view name, size_t& count) const
+    {
+        auto found = section(name);
+        count = found.size / sizeof(T);
+        return count == 0 ? nullptr : reinterpret_cast<T*>(found.data);
+    }
+};
+
+// the sections of a module kdeploy patches
+struct ModuleSections {
+    ElfW(Rela)* this_module_rela { nullptr };
+    size_t rela_num { 0 };
+    SymbolVersion* versions { nullptr };
+    size_t vers_num { 0 };
+    RuntimeInformation* runtime_info { nullptr };
+    // where the placeholders are
+    ModuleView::Section modinfo {};
+    ModuleView::Section this_module {};
+};
+
+// pointers into module_ko, all null if it is not an ELF file or a section is out of the file
+ModuleSections find_module_sections(std::vector<char>& module_ko);
+
+// relocate mod->{init, exit}
+void relocate_this_module(ModuleSections& sections, uintptr_t module_init_offset, uintptr_t module_exit_offset);
+
+// one module of a batch
+struct ModuleJob {
+    std::string input;
+    std::string output;
+    std::vector<char> ko {};
+    ModuleSections sections {};
+
+    bool pgd_required() const
+    {
+        return sections.runtime_info and sections.runtime_info->mm_pgd_required;
+    }
+
+    // relocations of mod->init or mod->exit, they need the module layout of the kernel
+    bool layout_required() const;
+
+    bool versions_required() const { return sections.vers_num != 0; }
+};
+
+// whether the profile has everything the module needs
+bool profile_covers(const KernelProfile& profile, const ModuleJob& job);
+
+void patch_module(const KernelProfile& profile, ModuleJob& job);
+
+// the vermagic and name placeholders, only .modinfo and .gnu.linkonce.this_module hold them
+void fill_placeholders(ModuleSections& sections, const std::string& vermagic);
+
+int write_module(const std::vector<char>& module_ko, const std::string& output_file);
+
+// patch and write every module with an output in parallel, then load them in order if `load`
+int patch_modules(const KernelProfile& profile, std::vector<ModuleJob>& jobs, bool load);
+
+// load a patched module into the running kernel from memory, 0 or the errno of the kernel
+int load_module(const std::vector<char>& module_ko);
+
+#endif
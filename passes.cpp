@@ -0,0 +1,56 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include <boost/log/trivial.hpp>
+
+#include "passes.h"
+
+using namespace std::string_literals;
+
+void PassBase::ensure()
+{
+    if (_state == State::Done) {
+        return;
+    }
+
+    if (_state == State::Running) {
+        throw std::logic_error("pass depends on itself: "s + _name);
+    }
+
+    _state = State::Running;
+
+    try {
+        for (auto* dependency : _dependencies) {
+            dependency->ensure();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+        BOOST_LOG_TRIVIAL(debug) << "pass " << _name << " " << elapsed.count() << " ms";
+
+    } catch (...) {
+        _state = State::Pending;
+        throw;
+    }
+
+    _state = State::Done;
+}
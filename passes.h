@@ -0,0 +1,91 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __passes_h__
+#define __passes_h__
+
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/*
+    One lazily computed analysis result.
+
+    A pass runs once, on first use, after the passes it declares as
+    dependencies, and keeps its result. Passes nobody asks for never run.
+    A failed pass throws and is run again on the next use.
+*/
+class PassBase {
+    const char* _name;
+    std::vector<PassBase*> _dependencies;
+
+    enum class State {
+        Pending,
+        Running,
+        Done,
+    } _state { State::Pending };
+
+protected:
+    virtual void run() = 0;
+
+public:
+    PassBase(const char* name, std::vector<PassBase*> dependencies)
+        : _name(name)
+        , _dependencies(std::move(dependencies))
+    {
+    }
+
+    virtual ~PassBase() = default;
+
+    PassBase(const PassBase&) = delete;
+    PassBase& operator=(const PassBase&) = delete;
+
+    // the dependencies in order, then the pass itself, once
+    void ensure();
+
+    const char* name() const { return _name; }
+    bool done() const { return _state == State::Done; }
+
+    const std::vector<PassBase*>& dependencies() const { return _dependencies; }
+};
+
+template <typename T>
+class Pass : public PassBase {
+    std::function<T()> _compute;
+    std::optional<T> _value {};
+
+protected:
+    void run() override
+    {
+        _value.emplace(_compute());
+    }
+
+public:
+    Pass(const char* name, std::vector<PassBase*> dependencies, std::function<T()> compute)
+        : PassBase(name, std::move(dependencies))
+        , _compute(std::move(compute))
+    {
+    }
+
+    T& get()
+    {
+        ensure();
+        return *_value;
+    }
+};
+
+#endif
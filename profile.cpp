@@ -0,0 +1,517 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/log/trivial.hpp>
+
+#include "profile.h"
+#include "utils.h"
+
+constexpr char profile_magic[8] = { 'K', 'D', 'P', 'R', 'O', 'F', '\0', '\0' };
+constexpr uint32_t profile_version = 2;
+
+constexpr char database_magic[8] = { 'K', 'D', 'P', 'R', 'O', 'D', 'B', '\0' };
+constexpr uint32_t database_version = 1;
+
+static uint64_t fnv1a(const char* data, size_t size, uint64_t hash = UINT64_C(0xcbf29ce484222325))
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+static std::string to_hex(const uint8_t* data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    std::string hex {};
+    hex.reserve(size * 2);
+    for (size_t i = 0; i < size; ++i) {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0xf]);
+    }
+    return hex;
+}
+
+// the NT_GNU_BUILD_ID descriptor of a note section, as hex
+static std::string find_build_id(const char* notes, size_t size)
+{
+    auto align = [](size_t n) { return (n + 3) & ~size_t { 3 }; };
+
+    size_t pos = 0;
+    while (pos + sizeof(Elf64_Nhdr) <= size) {
+        Elf64_Nhdr note {};
+        memcpy(&note, notes + pos, sizeof(note));
+
+        auto name = pos + sizeof(note);
+        auto desc = name + align(note.n_namesz);
+        auto next = desc + align(note.n_descsz);
+        if (next > size or next <= pos) {
+            break;
+        }
+
+        if (note.n_type == NT_GNU_BUILD_ID and note.n_namesz == 4 and memcmp(notes + name, "GNU", 4) == 0) {
+            return to_hex(reinterpret_cast<const uint8_t*>(notes + desc), note.n_descsz);
+        }
+        pos = next;
+    }
+    return {};
+}
+
+// procfs and sysfs files report no size, read to the end
+static std::string read_all(const char* filename)
+{
+    UniqueFD fd { ::open(filename, O_RDONLY) };
+    if (not fd) {
+        return {};
+    }
+
+    std::string content {};
+    char buffer[4096];
+    while (true) {
+        auto sz = ::read(fd.get(), buffer, sizeof(buffer));
+        if (sz <= 0) {
+            break;
+        }
+        content.append(buffer, sz);
+    }
+    return content;
+}
+
+static std::string trim_banner(std::string_view banner)
+{
+    while (not banner.empty() and (banner.back() == '\n' or banner.back() == ' ')) {
+        banner.remove_suffix(1);
+    }
+    return std::string { banner };
+}
+
+uint64_t KernelIdentity::key() const
+{
+    auto hash = fnv1a(build_id.data(), build_id.size());
+    hash = fnv1a("", 1, hash);
+    return fnv1a(banner.data(), banner.size(), hash);
+}
+
+std::string KernelIdentity::file_name() const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.kprof", static_cast<unsigned long long>(key()));
+    return name;
+}
+
+KernelIdentity running_kernel_identity()
+{
+    KernelIdentity identity {};
+
+    auto notes = read_all("/sys/kernel/notes");
+    identity.build_id = find_build_id(notes.data(), notes.size());
+    identity.banner = trim_banner(read_all("/proc/version"));
+    return identity;
+}
+
+KernelIdentity image_kernel_identity(KernelInformation& ki)
+{
+    KernelIdentity identity {};
+
+    auto in_image = [&](uintptr_t addr, size_t size) {
+        return addr >= ki.sym_text and addr - ki.sym_text <= ki.buffer.size()
+            and size <= ki.buffer.size() - (addr - ki.sym_text);
+    };
+
+    auto start_notes = ki.find_symbol("__start_notes");
+    auto stop_notes = ki.find_symbol("__stop_notes");
+    if (start_notes != 0 and stop_notes > start_notes and in_image(start_notes, stop_notes - start_notes)) {
+        auto size = stop_notes - start_notes;
+        identity.build_id = find_build_id(ki.ptr_of_sym<const char*>(start_notes, size), size);
+    }
+
+    auto linux_banner = ki.find_symbol("linux_banner");
+    if (linux_banner != 0 and in_image(linux_banner, 1)) {
+        auto* banner = ki.ptr_of_sym<const char*>(linux_banner);
+        auto limit = ki.buffer.size() - ki.offset(linux_banner);
+        identity.banner = trim_banner({ banner, strnlen(banner, std::min<size_t>(limit, 1024)) });
+    }
+
+    return identity;
+}
+
+void KernelProfile::add_symbol(std::string_view name, uint64_t crc)
+{
+    symbols.push_back({ static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size()), crc });
+    names.insert(names.end(), name.begin(), name.end());
+}
+
+void KernelProfile::sort_symbols()
+{
+    auto name_of = [&](const Symbol& symbol) {
+        return std::string_view { names.data() + symbol.name, symbol.size };
+    };
+
+    std::sort(symbols.begin(), symbols.end(), [&](const Symbol& a, const Symbol& b) {
+        return name_of(a) < name_of(b);
+    });
+
+    // a name exported twice resolves to the same crc
+    symbols.erase(std::unique(symbols.begin(), symbols.end(), [&](const Symbol& a, const Symbol& b) {
+        return name_of(a) == name_of(b);
+    }),
+        symbols.end());
+}
+
+const uint64_t* KernelProfile::find_crc(std::string_view name) const
+{
+    auto iter = std::lower_bound(symbols.begin(), symbols.end(), name, [&](const Symbol& symbol, std::string_view name) {
+        return std::string_view { names.data() + symbol.name, symbol.size } < name;
+    });
+
+    if (iter == symbols.end() or std::string_view { names.data() + iter->name, iter->size } != name) {
+        return nullptr;
+    }
+    return &iter->crc;
+}
+
+namespace {
+
+class ProfileWriter {
+    std::vector<char> _data {};
+
+public:
+    template <typename T>
+    void put(const T& value)
+    {
+        auto* bytes = reinterpret_cast<const char*>(&value);
+        _data.insert(_data.end(), bytes, bytes + sizeof(value));
+    }
+
+    void put_bytes(const char* data, size_t size)
+    {
+        put(static_cast<uint32_t>(size));
+        _data.insert(_data.end(), data, data + size);
+    }
+
+    std::vector<char>& data() { return _data; }
+};
+
+class ProfileReader {
+    const char* _pos;
+    const char* _end;
+
+public:
+    ProfileReader(const char* data, size_t size)
+        : _pos(data)
+        , _end(data + size)
+    {
+    }
+
+    template <typename T>
+    T get()
+    {
+        T value {};
+        if (static_cast<size_t>(_end - _pos) < sizeof(value)) {
+            throw std::runtime_error { "truncated profile" };
+        }
+        memcpy(&value, _pos, sizeof(value));
+        _pos += sizeof(value);
+        return value;
+    }
+
+    std::string_view get_bytes()
+    {
+        auto size = get<uint32_t>();
+        if (static_cast<size_t>(_end - _pos) < size) {
+            throw std::runtime_error { "truncated profile" };
+        }
+        std::string_view bytes { _pos, size };
+        _pos += size;
+        return bytes;
+    }
+
+    bool done() const { return _pos == _end; }
+};
+
+}
+
+// written to a temporary file and renamed into place
+static bool write_atomically(const std::string& filename, const std::vector<char>& data)
+{
+    auto temporary = filename + ".tmp";
+    {
+        UniqueFD fd { ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+        if (not fd) {
+            BOOST_LOG_TRIVIAL(error) << "Unable open " << temporary << " " << strerror(errno);
+            return false;
+        }
+        if (::write(fd.get(), data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write " << temporary << " " << strerror(errno);
+            ::unlink(temporary.c_str());
+            return false;
+        }
+    }
+
+    if (::rename(temporary.c_str(), filename.c_str()) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Unable rename " << temporary << " " << strerror(errno);
+        ::unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool KernelProfile::load(const std::string& filename)
+{
+    UniqueFD fd { ::open(filename.c_str(), O_RDONLY) };
+    if (not fd) {
+        return false;
+    }
+
+    auto data = read_file(fd.get());
+    return parse(data.data(), data.size(), filename);
+}
+
+bool KernelProfile::parse(const char* data, size_t size, const std::string& origin)
+{
+    if (size < sizeof(profile_magic) + sizeof(uint64_t)
+        or memcmp(data, profile_magic, sizeof(profile_magic)) != 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Not a kernel profile " << origin;
+        return false;
+    }
+
+    size -= sizeof(uint64_t);
+    uint64_t checksum {};
+    memcpy(&checksum, data + size, sizeof(checksum));
+    if (checksum != fnv1a(data, size)) {
+        BOOST_LOG_TRIVIAL(warning) << "Damaged kernel profile " << origin;
+        return false;
+    }
+
+    try {
+        ProfileReader reader { data + sizeof(profile_magic), size - sizeof(profile_magic) };
+
+        if (reader.get<uint32_t>() != profile_version) {
+            BOOST_LOG_TRIVIAL(warning) << "Kernel profile of another version " << origin;
+            return false;
+        }
+
+        identity.build_id = reader.get_bytes();
+        identity.banner = reader.get_bytes();
+        vermagic = reader.get_bytes();
+
+        module_init_offset = reader.get<uint64_t>();
+        module_exit_offset = reader.get<uint64_t>();
+        symbol_struct_type = static_cast<KernelSymbolStructType>(reader.get<uint32_t>());
+        kaslr = reader.get<uint64_t>();
+        default_base = reader.get<uint64_t>();
+        relocated_kcrctab = reader.get<uint32_t>() != 0;
+
+        mm_pgd_valid = reader.get<uint32_t>() != 0;
+        mm_pgd_offset = reader.get<uint64_t>();
+
+        auto arena = reader.get_bytes();
+        names.assign(arena.begin(), arena.end());
+
+        auto table = reader.get_bytes();
+        if (table.size() % sizeof(Symbol) != 0) {
+            throw std::runtime_error { "bad symbol table" };
+        }
+        symbols.resize(table.size() / sizeof(Symbol));
+        memcpy(symbols.data(), table.data(), table.size());
+
+        for (auto& symbol : symbols) {
+            if (symbol.name > names.size() or symbol.size > names.size() - symbol.name) {
+                throw std::runtime_error { "symbol name out of the arena" };
+            }
+        }
+
+        if (not reader.done()) {
+            throw std::runtime_error { "trailing data" };
+        }
+
+    } catch (std::exception& e) {
+        BOOST_LOG_TRIVIAL(warning) << "Invalid kernel profile " << origin << ": " << e.what();
+        return false;
+    }
+
+    // bound to one boot, never reused
+    if (not reusable()) {
+        BOOST_LOG_TRIVIAL(warning) << "Kernel profile with boot relocated crcs " << origin;
+        return false;
+    }
+
+    return true;
+}
+
+bool KernelProfile::save(const std::string& filename) const
+{
+    if (not reusable()) {
+        BOOST_LOG_TRIVIAL(warning) << "kernel profile not saved, its crcs depend on the kaslr offset of this boot";
+        return false;
+    }
+    return write_atomically(filename, serialize());
+}
+
+std::vector<char> KernelProfile::serialize() const
+{
+    ProfileWriter writer {};
+
+    writer.data().assign(profile_magic, profile_magic + sizeof(profile_magic));
+    writer.put(profile_version);
+
+    writer.put_bytes(identity.build_id.data(), identity.build_id.size());
+    writer.put_bytes(identity.banner.data(), identity.banner.size());
+    writer.put_bytes(vermagic.data(), vermagic.size());
+
+    writer.put(module_init_offset);
+    writer.put(module_exit_offset);
+    writer.put(static_cast<uint32_t>(symbol_struct_type));
+    writer.put(kaslr);
+    writer.put(default_base);
+    writer.put(static_cast<uint32_t>(relocated_kcrctab));
+
+    writer.put(static_cast<uint32_t>(mm_pgd_valid));
+    writer.put(mm_pgd_offset);
+
+    writer.put_bytes(names.data(), names.size());
+    writer.put_bytes(reinterpret_cast<const char*>(symbols.data()), symbols.size() * sizeof(Symbol));
+
+    auto& data = writer.data();
+    writer.put(fnv1a(data.data(), data.size()));
+    return std::move(data);
+}
+
+namespace {
+
+struct DatabaseEntry {
+    uint64_t key;
+    uint64_t offset;
+    uint64_t size;
+};
+
+}
+
+bool save_profile_database(const std::string& filename, const std::vector<KernelProfile>& profiles)
+{
+    std::vector<DatabaseEntry> index {};
+    std::vector<std::vector<char>> blobs {};
+
+    for (auto& profile : profiles) {
+        if (not profile.reusable()) {
+            BOOST_LOG_TRIVIAL(warning) << "kernel " << profile.vermagic << " with boot relocated crcs left out";
+            continue;
+        }
+
+        auto key = profile.identity.key();
+        if (std::any_of(index.begin(), index.end(), [&](const DatabaseEntry& entry) { return entry.key == key; })) {
+            BOOST_LOG_TRIVIAL(warning) << "duplicate kernel " << profile.vermagic << ", first one kept";
+            continue;
+        }
+        index.push_back({ key, 0, 0 });
+        blobs.push_back(profile.serialize());
+    }
+
+    // the index is sorted by key, the profiles stay in their order
+    std::vector<size_t> order(index.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return index[a].key < index[b].key; });
+
+    ProfileWriter writer {};
+    writer.data().assign(database_magic, database_magic + sizeof(database_magic));
+    writer.put(database_version);
+    writer.put(static_cast<uint32_t>(index.size()));
+
+    uint64_t offset = writer.data().size() + index.size() * sizeof(DatabaseEntry);
+    for (size_t i = 0; i < index.size(); ++i) {
+        index[i].offset = offset;
+        index[i].size = blobs[i].size();
+        offset += blobs[i].size();
+    }
+
+    for (auto i : order) {
+        writer.put(index[i]);
+    }
+
+    auto& data = writer.data();
+    for (auto& blob : blobs) {
+        data.insert(data.end(), blob.begin(), blob.end());
+    }
+
+    return write_atomically(filename, data);
+}
+
+bool load_profile_database(const std::string& filename, const KernelIdentity& identity, KernelProfile& profile)
+{
+    UniqueFD fd { ::open(filename.c_str(), O_RDONLY) };
+    if (not fd) {
+        return false;
+    }
+
+    struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+    } header {};
+
+    if (::pread(fd.get(), &header, sizeof(header), 0) != sizeof(header)
+        or memcmp(header.magic, database_magic, sizeof(database_magic)) != 0
+        or header.version != database_version) {
+        BOOST_LOG_TRIVIAL(warning) << "Not a kernel profile database " << filename;
+        return false;
+    }
+
+    auto file_size = ::lseek(fd.get(), 0, SEEK_END);
+    if (file_size < 0 or header.count > (file_size - sizeof(header)) / sizeof(DatabaseEntry)) {
+        BOOST_LOG_TRIVIAL(warning) << "Damaged kernel profile database " << filename;
+        return false;
+    }
+
+    std::vector<DatabaseEntry> index(header.count);
+    auto index_size = index.size() * sizeof(DatabaseEntry);
+    if (::pread(fd.get(), index.data(), index_size, sizeof(header)) != static_cast<ssize_t>(index_size)) {
+        return false;
+    }
+
+    auto key = identity.key();
+    auto entry = std::lower_bound(index.begin(), index.end(), key, [](const DatabaseEntry& entry, uint64_t key) {
+        return entry.key < key;
+    });
+    if (entry == index.end() or entry->key != key) {
+        return false;
+    }
+
+    if (entry->offset > static_cast<uint64_t>(file_size) or entry->size > file_size - entry->offset) {
+        BOOST_LOG_TRIVIAL(warning) << "Damaged kernel profile database " << filename;
+        return false;
+    }
+
+    std::vector<char> blob(entry->size);
+    if (::pread(fd.get(), blob.data(), blob.size(), entry->offset) != static_cast<ssize_t>(blob.size())) {
+        return false;
+    }
+
+    // the key is a hash, the profile tells its kernel
+    return profile.parse(blob.data(), blob.size(), filename) and profile.identity == identity;
+}
@@ -0,0 +1,123 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __profile_h__
+#define __profile_h__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "kdeploy.h"
+
+/*
+    What tells two kernel builds apart without reading the image: the GNU
+    build-id note and the banner, the same bytes the running kernel shows
+    in /sys/kernel/notes and /proc/version.
+*/
+struct KernelIdentity {
+    std::string build_id {}; // hex, empty if the kernel has no build-id note
+    std::string banner {};
+
+    bool empty() const { return build_id.empty() and banner.empty(); }
+
+    bool operator==(const KernelIdentity& other) const
+    {
+        return build_id == other.build_id and banner == other.banner;
+    }
+
+    // hash of both, keys the cache and the database
+    uint64_t key() const;
+
+    // file name of the profile in a cache directory
+    std::string file_name() const;
+};
+
+// the identity of the running kernel, empty if neither file is readable
+KernelIdentity running_kernel_identity();
+
+// the identity of the analysed image, from __start_notes/__stop_notes and linux_banner
+KernelIdentity image_kernel_identity(KernelInformation& ki);
+
+/*
+    Everything patching a module needs from the analysis of one kernel.
+
+    Stored as a flat binary file, native endian, checked by a trailing
+    FNV-1a hash. Exported symbol CRCs are kept sorted by name in one
+    name arena.
+*/
+struct KernelProfile {
+    struct Symbol {
+        uint32_t name; // offset in the arena
+        uint32_t size;
+        uint64_t crc;
+    };
+
+    KernelIdentity identity {};
+    std::string vermagic {};
+
+    uint64_t module_init_offset { 0 };
+    uint64_t module_exit_offset { 0 };
+    KernelSymbolStructType symbol_struct_type { KernelSymbolStructType::None };
+    uint64_t kaslr { 0 };
+    uint64_t default_base { 0 };
+
+    // relocatable arm64 kernels before 4.11 relocate kcrctab at boot, the
+    // crcs then hold for the kaslr offset of the analysed boot only
+    bool relocated_kcrctab { false };
+
+    // RuntimeInformation
+    bool mm_pgd_valid { false };
+    uint64_t mm_pgd_offset { 0 };
+
+    std::vector<char> names {};
+    std::vector<Symbol> symbols {};
+
+    // unsorted until sort_symbols()
+    void add_symbol(std::string_view name, uint64_t crc);
+    void sort_symbols();
+
+    // nullptr if the symbol is not exported
+    const uint64_t* find_crc(std::string_view name) const;
+
+    // false if the file is missing, damaged or of another format version
+    bool load(const std::string& filename);
+
+    // the same for every boot of the kernel, only such a profile is cached
+    bool reusable() const { return not relocated_kcrctab; }
+
+    // written to a temporary file and renamed into place, false if it is not reusable
+    bool save(const std::string& filename) const;
+
+    // the file format, `origin` names the data in warnings
+    bool parse(const char* data, size_t size, const std::string& origin);
+    std::vector<char> serialize() const;
+};
+
+/*
+    Profiles of many kernels in one file, built offline by profile-build.
+
+    A header and an index of {identity key, offset, size} sorted by key,
+    followed by the profiles in their file format. A lookup reads the
+    index and the one profile it points to.
+*/
+bool save_profile_database(const std::string& filename, const std::vector<KernelProfile>& profiles);
+
+// false if the database has no profile of `identity`
+bool load_profile_database(const std::string& filename, const KernelIdentity& identity, KernelProfile& profile);
+
+#endif
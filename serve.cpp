@@ -0,0 +1,298 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <boost/log/trivial.hpp>
+
+#include "module.h"
+#include "serve.h"
+#include "utils.h"
+
+// requests handled at the same time, each may hold a module of up to serve_max_module_size
+constexpr size_t serve_max_connections = 8;
+
+static std::atomic<size_t> active_connections { 0 };
+
+// a client that stops sending or reading gives its slot back after this
+constexpr time_t serve_io_timeout = 30;
+
+static bool read_full(int fd, void* data, size_t size)
+{
+    auto* ptr = static_cast<char*>(data);
+    while (size != 0) {
+        auto sz = ::read(fd, ptr, size);
+        if (sz == -1 and errno == EINTR) {
+            continue;
+        }
+        if (sz <= 0) {
+            return false;
+        }
+        ptr += sz;
+        size -= sz;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* data, size_t size)
+{
+    auto* ptr = static_cast<const char*>(data);
+    while (size != 0) {
+        auto sz = ::send(fd, ptr, size, MSG_NOSIGNAL);
+        if (sz == -1 and errno == EINTR) {
+            continue;
+        }
+        if (sz <= 0) {
+            return false;
+        }
+        ptr += sz;
+        size -= sz;
+    }
+    return true;
+}
+
+static bool socket_address(const std::string& socket_path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        BOOST_LOG_TRIVIAL(error) << "socket path too long " << socket_path;
+        return false;
+    }
+    memcpy(address.sun_path, socket_path.data(), socket_path.size());
+    return true;
+}
+
+static void respond(int fd, int32_t status, const char* data, size_t size)
+{
+    ServeResponse response { serve_magic, status, size };
+    if (write_full(fd, &response, sizeof(response))) {
+        write_full(fd, data, size);
+    }
+}
+
+static void respond_error(int fd, int32_t status, const std::string& message)
+{
+    BOOST_LOG_TRIVIAL(error) << "request failed: " << message;
+    respond(fd, status, message.data(), message.size());
+}
+
+static void handle(const KernelProfile& profile, UniqueFD client)
+{
+    // loaded modules run as the server, only its own user and root may ask
+    ucred peer {};
+    socklen_t peer_size = sizeof(peer);
+    if (::getsockopt(client.get(), SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) == -1) {
+        BOOST_LOG_TRIVIAL(error) << "Unable get peer credentials " << strerror(errno);
+        return;
+    }
+    if (peer.uid != ::getuid() and peer.uid != 0) {
+        respond_error(client.get(), -1, "permission denied for uid " + std::to_string(peer.uid));
+        return;
+    }
+
+    ServeRequest request {};
+    if (not read_full(client.get(), &request, sizeof(request)) or request.magic != serve_magic) {
+        BOOST_LOG_TRIVIAL(debug) << "invalid request";
+        return;
+    }
+
+    auto op = static_cast<ServeOp>(request.op);
+    if (op != ServeOp::Patch and op != ServeOp::Load) {
+        respond_error(client.get(), -1, "unknown request " + std::to_string(request.op));
+        return;
+    }
+    if (request.size == 0 or request.size > serve_max_module_size) {
+        respond_error(client.get(), -1, "module size " + std::to_string(request.size) + " out of range");
+        return;
+    }
+
+    ModuleJob job {};
+    job.input = "request";
+    job.ko.resize(request.size);
+    if (not read_full(client.get(), job.ko.data(), job.ko.size())) {
+        BOOST_LOG_TRIVIAL(debug) << "truncated request";
+        return;
+    }
+
+    job.sections = find_module_sections(job.ko);
+    if (job.sections.this_module.data == nullptr) {
+        respond_error(client.get(), -1, ".gnu.linkonce.this_module not found");
+        return;
+    }
+    if (not profile_covers(profile, job)) {
+        respond_error(client.get(), -1, "the module needs runtime information the analysis does not have");
+        return;
+    }
+
+    patch_module(profile, job);
+    fill_placeholders(job.sections, profile.vermagic);
+
+    if (op == ServeOp::Patch) {
+        respond(client.get(), 0, job.ko.data(), job.ko.size());
+        return;
+    }
+
+    auto error = load_module(job.ko);
+    if (error != 0) {
+        respond_error(client.get(), error, "init_module: "s + strerror(error));
+        return;
+    }
+
+    BOOST_LOG_TRIVIAL(info) << "module loaded";
+    respond(client.get(), 0, nullptr, 0);
+}
+
+int serve(const KernelProfile& profile, const std::string& socket_path)
+{
+    sockaddr_un address {};
+    if (not socket_address(socket_path, address)) {
+        return -1;
+    }
+
+    UniqueFD server { ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+    if (not server) {
+        BOOST_LOG_TRIVIAL(error) << "Unable create socket " << strerror(errno);
+        return -1;
+    }
+
+    // a socket left by an earlier run, nothing else is removed
+    struct stat status { };
+    if (::lstat(socket_path.c_str(), &status) == 0) {
+        if (not S_ISSOCK(status.st_mode)) {
+            BOOST_LOG_TRIVIAL(error) << socket_path << " exists and is not a socket";
+            return -1;
+        }
+        ::unlink(socket_path.c_str());
+    }
+
+    // patched modules are loadable, only the owner may ask for them.
+    // the socket never exists with group or other access
+    auto mask = ::umask(077);
+    auto bound = ::bind(server.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    auto bind_error = errno;
+    ::umask(mask);
+
+    if (bound == -1) {
+        BOOST_LOG_TRIVIAL(error) << "Unable bind " << socket_path << " " << strerror(bind_error);
+        return -1;
+    }
+
+    if (::chmod(socket_path.c_str(), 0600) == -1) {
+        BOOST_LOG_TRIVIAL(error) << "Unable chmod " << socket_path << " " << strerror(errno);
+        return -1;
+    }
+
+    if (::listen(server.get(), 16) == -1) {
+        BOOST_LOG_TRIVIAL(error) << "Unable listen " << socket_path << " " << strerror(errno);
+        return -1;
+    }
+
+    BOOST_LOG_TRIVIAL(info) << "serving " << socket_path;
+
+    while (true) {
+        UniqueFD client { ::accept4(server.get(), nullptr, nullptr, SOCK_CLOEXEC) };
+        if (not client) {
+            if (errno == EINTR or errno == ECONNABORTED) {
+                continue;
+            }
+            BOOST_LOG_TRIVIAL(error) << "Unable accept " << strerror(errno);
+
+            // the requests in flight still use the profile
+            while (active_connections != 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            return -1;
+        }
+
+        timeval timeout { serve_io_timeout, 0 };
+        if (::setsockopt(client.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+            or ::setsockopt(client.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+            BOOST_LOG_TRIVIAL(error) << "Unable set socket timeout " << strerror(errno);
+            continue;
+        }
+
+        if (active_connections >= serve_max_connections) {
+            respond_error(client.get(), -1, "too many requests");
+            continue;
+        }
+
+        // the profile is read only, requests run side by side
+        ++active_connections;
+        std::thread { [&profile](UniqueFD client) {
+                         auto done = ScopeTail([]() {
+                             --active_connections;
+                         });
+                         try {
+                             handle(profile, std::move(client));
+                         } catch (std::exception& e) {
+                             BOOST_LOG_TRIVIAL(error) << "request failed: " << e.what();
+                         }
+                     },
+            std::move(client) }
+            .detach();
+    }
+}
+
+int serve_request(const std::string& socket_path, ServeOp op, const std::vector<char>& module_ko, std::vector<char>& reply)
+{
+    sockaddr_un address {};
+    if (not socket_address(socket_path, address)) {
+        return -1;
+    }
+
+    UniqueFD fd { ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+    if (not fd) {
+        BOOST_LOG_TRIVIAL(error) << "Unable create socket " << strerror(errno);
+        return -1;
+    }
+
+    if (::connect(fd.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+        BOOST_LOG_TRIVIAL(error) << "Unable connect " << socket_path << " " << strerror(errno);
+        return -1;
+    }
+
+    ServeRequest request { serve_magic, static_cast<uint32_t>(op), module_ko.size() };
+    if (not write_full(fd.get(), &request, sizeof(request)) or not write_full(fd.get(), module_ko.data(), module_ko.size())) {
+        BOOST_LOG_TRIVIAL(error) << "Unable send request " << strerror(errno);
+        return -1;
+    }
+
+    ServeResponse response {};
+    if (not read_full(fd.get(), &response, sizeof(response)) or response.magic != serve_magic
+        or response.size > serve_max_module_size) {
+        BOOST_LOG_TRIVIAL(error) << "Invalid response";
+        return -1;
+    }
+
+    reply.resize(response.size);
+    if (not read_full(fd.get(), reply.data(), reply.size())) {
+        BOOST_LOG_TRIVIAL(error) << "Truncated response";
+        return -1;
+    }
+
+    return response.status;
+}
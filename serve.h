@@ -0,0 +1,58 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __serve_h__
+#define __serve_h__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "profile.h"
+
+/*
+    Resident mode. The analysed kernel is kept as a KernelProfile and a
+    Unix socket takes one request per connection: a ServeRequest and
+    the module, answered by a ServeResponse and the patched module, or
+    a message if the status is not 0.
+*/
+enum class ServeOp : uint32_t {
+    Patch = 1, // return the patched module
+    Load = 2, // load the patched module, status is 0 or an errno
+};
+
+constexpr uint32_t serve_magic = 0x4b44504c; // KDPL
+constexpr uint64_t serve_max_module_size = 64 << 20;
+
+struct ServeRequest {
+    uint32_t magic;
+    uint32_t op;
+    uint64_t size;
+};
+
+struct ServeResponse {
+    uint32_t magic;
+    int32_t status;
+    uint64_t size;
+};
+
+// serve until the process is killed, returns only if the socket can not be set up
+int serve(const KernelProfile& profile, const std::string& socket_path);
+
+// send one module, `reply` is the patched module or the error message. Returns the status, -1 if the server is unreachable
+int serve_request(const std::string& socket_path, ServeOp op, const std::vector<char>& module_ko, std::vector<char>& reply);
+
+#endif
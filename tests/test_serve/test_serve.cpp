@@ -0,0 +1,171 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "kagent/private.h"
+
+namespace po = boost::program_options;
+namespace fs = std::filesystem;
+
+static pid_t spawn(const std::vector<std::string>& args)
+{
+    std::vector<char*> argv {};
+    for (auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    // posix_spawn needs android-28
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+static int run(const std::vector<std::string>& args)
+{
+    auto pid = spawn(args);
+    if (pid == -1) {
+        return -1;
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static std::vector<char> read_all(const fs::path& path)
+{
+    std::ifstream file { path, std::ios::binary };
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+static bool wait_socket(const std::string& path, int seconds)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < deadline) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        auto connected = ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        ::close(fd);
+        if (connected) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+/*
+    Patch a module once directly and once through a kdeploy --serve
+    instance, the outputs must match apart from the random name. `server`
+    is set as soon as the server is started.
+*/
+static int compare(const std::string& kdeploy, const std::string& module, const std::string& kernel,
+    const std::string& symbol_map, int requests, const fs::path& dir, pid_t& server)
+{
+    auto socket_path = (dir / "kdeploy.sock").string();
+    auto direct = (dir / "direct.ko").string();
+
+    if (run({ kdeploy, "-m", module, "-k", kernel, "-s", symbol_map, "-o", direct }) != 0) {
+        std::cerr << "direct kdeploy failed" << std::endl;
+        return -1;
+    }
+
+    server = spawn({ kdeploy, "--serve", socket_path, "-k", kernel, "-s", symbol_map });
+    if (server == -1 or not wait_socket(socket_path, 60)) {
+        std::cerr << "kdeploy --serve did not come up" << std::endl;
+        return -1;
+    }
+
+    // the random name is the only byte range allowed to differ
+    auto original = read_all(module);
+    std::vector<bool> random_name(original.size(), false);
+    for (auto* ptr = original.data(); (ptr = static_cast<char*>(memmem(ptr, original.data() + original.size() - ptr,
+                                            RANDOM_NAME_PLACEHOLDER, sizeof(RANDOM_NAME_PLACEHOLDER))));
+         ptr += sizeof(RANDOM_NAME_PLACEHOLDER)) {
+        std::fill_n(random_name.begin() + (ptr - original.data()), sizeof(RANDOM_NAME_PLACEHOLDER), true);
+    }
+
+    auto expected = read_all(direct);
+
+    int failed = 0;
+    for (int i = 0; i < requests; ++i) {
+        auto served = (dir / ("served" + std::to_string(i) + ".ko")).string();
+
+        auto start = std::chrono::steady_clock::now();
+        auto status = run({ kdeploy, "--client", socket_path, "-m", module, "-o", served });
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        auto output = read_all(served);
+        bool same = status == 0 and output.size() == expected.size();
+        for (size_t pos = 0; same and pos < output.size(); ++pos) {
+            same = output[pos] == expected[pos] or (pos < random_name.size() and random_name[pos]);
+        }
+
+        std::cout << "request " << i << " " << elapsed << " ms " << (same ? "pass" : "FAIL") << std::endl;
+        failed += not same;
+    }
+
+    std::cout << "pass " << (int)(failed == 0) << std::endl;
+    return failed == 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    po::options_description desc { "Options" };
+    desc.add_options()("help", "show help message");
+    desc.add_options()("kdeploy", po::value<std::string>()->default_value("./kdeploy"), "kdeploy binary");
+    desc.add_options()("module,m", po::value<std::string>(), "module file");
+    desc.add_options()("kernel,k", po::value<std::string>(), "kernel image");
+    desc.add_options()("symbol-map,s", po::value<std::string>(), "symbol map");
+    desc.add_options()("requests,n", po::value<int>()->default_value(8), "requests sent to the server");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help") or not vm.count("module") or not vm.count("kernel") or not vm.count("symbol-map")) {
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : -1;
+    }
+
+    auto kdeploy = fs::absolute(vm["kdeploy"].as<std::string>()).string();
+    auto module = vm["module"].as<std::string>();
+    auto kernel = vm["kernel"].as<std::string>();
+    auto symbol_map = vm["symbol-map"].as<std::string>();
+
+    auto dir = fs::temp_directory_path() / ("test_serve." + std::to_string(getpid()));
+    fs::create_directories(dir);
+
+    pid_t server = -1;
+    auto status = compare(kdeploy, module, kernel, symbol_map, vm["requests"].as<int>(), dir, server);
+
+    // on every path, the server is stopped and the directory removed
+    if (server != -1) {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+    }
+    fs::remove_all(dir);
+
+    return status;
+}
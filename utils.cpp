@@ -14,7 +14,9 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#include <linux/memfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <array>
 #include <random>
@@ -96,3 +98,8 @@ bool write_file(const std::string& filename, const std::string& content)
     }
     return true;
 }
+
+UniqueFD create_memfd(const char* name)
+{
+    return UniqueFD { static_cast<int>(::syscall(__NR_memfd_create, name, MFD_CLOEXEC)) };
+}
@@ -20,7 +20,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 template <typename F>
 auto ScopeTail(F&& func)
@@ -93,6 +98,56 @@ public:
     }
 };
 
+/*
+    Split [0, count) into one chunk per core and run func(begin, end) on
+    each, the calling thread takes the first chunk. Less than `grain` items
+    per chunk are not worth a thread. The first exception is rethrown after
+    every chunk finished.
+*/
+template <typename F>
+void parallel_for(size_t count, size_t grain, F&& func)
+{
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, count / std::max<size_t>(grain, 1));
+
+    if (workers <= 1) {
+        func(size_t { 0 }, count);
+        return;
+    }
+
+    size_t chunk = (count + workers - 1) / workers;
+
+    std::mutex mutex {};
+    std::exception_ptr error {};
+
+    auto run = [&](size_t begin) {
+        try {
+            func(begin, std::min(count, begin + chunk));
+        } catch (...) {
+            std::lock_guard<std::mutex> lock { mutex };
+            if (not error) {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads {};
+    threads.reserve(workers - 1);
+    for (size_t begin = chunk; begin < count; begin += chunk) {
+        threads.emplace_back(run, begin);
+    }
+
+    run(0);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 std::string get_random_string(size_t n);
 
 std::vector<char> read_file(int fd, ssize_t size=-1);
@@ -101,4 +156,7 @@ std::vector<char> read_file(const std::string& filename, ssize_t size=-1);
 
 bool write_file(const std::string& filename, const std::string& content);
 
+// anonymous file, not valid before 3.17. bionic declares memfd_create only from API 30
+UniqueFD create_memfd(const char* name);
+
 #endif
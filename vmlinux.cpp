@@ -0,0 +1,301 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <boost/log/trivial.hpp>
+
+#include "vmlinux.h"
+
+using namespace std::string_literals;
+
+std::optional<KernelArch> elf_kernel_arch(uint16_t machine)
+{
+    switch (machine) {
+    case EM_AARCH64:
+        return KernelArch::Arm64;
+    case EM_X86_64:
+        return KernelArch::X86_64;
+    }
+    return std::nullopt;
+}
+
+static bool valid_header(const Elf64_Ehdr& header)
+{
+    return memcmp(header.e_ident, ELFMAG, SELFMAG) == 0
+        and header.e_ident[EI_CLASS] == ELFCLASS64
+        and header.e_ident[EI_DATA] == ELFDATA2LSB;
+}
+
+bool ElfKernel::in_file(uint64_t offset, uint64_t size) const
+{
+    return offset <= _file_size and size <= _file_size - offset;
+}
+
+bool ElfKernel::open(UniqueFD fd)
+{
+    struct stat st { };
+    if (::fstat(fd.get(), &st) == -1) {
+        return false;
+    }
+
+    _fd = std::move(fd);
+    _file_size = st.st_size;
+
+    Elf64_Ehdr header {};
+    if (::pread(_fd.get(), &header, sizeof(header), 0) != sizeof(header)
+        or not valid_header(header)
+        or header.e_shentsize != sizeof(Elf64_Shdr)) {
+        return false;
+    }
+
+    _machine = header.e_machine;
+
+    // more than SHN_LORESERVE sections, the count and the names index move to section 0
+    size_t count = header.e_shnum;
+    size_t names = header.e_shstrndx;
+    if (count == 0 or names == SHN_XINDEX) {
+        Elf64_Shdr first {};
+        if (::pread(_fd.get(), &first, sizeof(first), header.e_shoff) != sizeof(first)) {
+            return false;
+        }
+        if (count == 0) {
+            count = first.sh_size;
+        }
+        if (names == SHN_XINDEX) {
+            names = first.sh_link;
+        }
+    }
+
+    if (not in_file(header.e_shoff, count * sizeof(Elf64_Shdr)) or names >= count) {
+        return false;
+    }
+
+    _sections.resize(count);
+    auto size = count * sizeof(Elf64_Shdr);
+    if (::pread(_fd.get(), _sections.data(), size, header.e_shoff) != static_cast<ssize_t>(size)) {
+        return false;
+    }
+
+    auto& strtab = _sections[names];
+    if (not in_file(strtab.sh_offset, strtab.sh_size)) {
+        return false;
+    }
+
+    // terminated, whatever the file holds
+    _names.resize(strtab.sh_size + 1);
+    if (::pread(_fd.get(), _names.data(), strtab.sh_size, strtab.sh_offset) != static_cast<ssize_t>(strtab.sh_size)) {
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "vmlinux " << _sections.size() << " sections machine " << _machine;
+
+    return true;
+}
+
+const Elf64_Shdr* ElfKernel::section(std::string_view name) const
+{
+    for (auto& section : _sections) {
+        if (section.sh_name < _names.size() and name == _names.data() + section.sh_name) {
+            return &section;
+        }
+    }
+    return nullptr;
+}
+
+uintptr_t ElfKernel::text_address() const
+{
+    uintptr_t text = UINTPTR_MAX;
+    for (auto& section : _sections) {
+        if ((section.sh_flags & SHF_ALLOC) and (section.sh_flags & SHF_EXECINSTR)
+            and section.sh_addr != 0 and section.sh_size != 0) {
+            text = std::min<uintptr_t>(text, section.sh_addr);
+        }
+    }
+    return text == UINTPTR_MAX ? 0 : text;
+}
+
+// the nm type letter, as in System.map
+static char symbol_type(const Elf64_Sym& sym, const std::vector<Elf64_Shdr>& sections)
+{
+    char type { 'r' };
+    if (sym.st_shndx == SHN_ABS) {
+        type = 'a';
+    } else if (sym.st_shndx < sections.size()) {
+        auto& section = sections[sym.st_shndx];
+        if (section.sh_flags & SHF_EXECINSTR) {
+            type = 't';
+        } else if (section.sh_type == SHT_NOBITS) {
+            type = 'b';
+        } else if (section.sh_flags & SHF_WRITE) {
+            type = 'd';
+        }
+    }
+
+    if (ELF64_ST_BIND(sym.st_info) != STB_LOCAL) {
+        type = toupper(type);
+    }
+    return type;
+}
+
+bool ElfKernel::load_symbols(SymbolIndex& symbols, const SymbolRequest* request) const
+{
+    auto* symtab = section(".symtab");
+    if (symtab == nullptr or symtab->sh_link >= _sections.size()) {
+        return false;
+    }
+
+    auto& strtab = _sections[symtab->sh_link];
+    if (not in_file(symtab->sh_offset, symtab->sh_size) or not in_file(strtab.sh_offset, strtab.sh_size)) {
+        return false;
+    }
+
+    // both tables are read in place
+    auto file = ImageBuffer::map(_fd.get(), _file_size);
+    auto* syms = reinterpret_cast<const Elf64_Sym*>(file.data() + symtab->sh_offset);
+    auto* strs = file.data() + strtab.sh_offset;
+    size_t count = symtab->sh_size / sizeof(Elf64_Sym);
+
+    if (request == nullptr) {
+        symbols.reserve(symbols.size() + count, strtab.sh_size);
+    }
+
+    // the first entry is the undefined symbol
+    for (size_t i = 1; i < count; ++i) {
+        auto& sym = syms[i];
+
+        auto type = ELF64_ST_TYPE(sym.st_info);
+        if (type == STT_SECTION or type == STT_FILE or sym.st_shndx == SHN_UNDEF or sym.st_name >= strtab.sh_size) {
+            continue;
+        }
+
+        std::string_view name { strs + sym.st_name, strnlen(strs + sym.st_name, strtab.sh_size - sym.st_name) };
+
+        if (request != nullptr and (request->find(name) == nullptr or symbols.find(name) != nullptr)) {
+            continue;
+        }
+
+        symbols.add(name, sym.st_value, symbol_type(sym, _sections));
+    }
+
+    return true;
+}
+
+ImageBuffer ElfKernel::map_image(uintptr_t text, size_t extent) const
+{
+    std::vector<const Elf64_Shdr*> placed {};
+    uintptr_t end = text;
+
+    for (auto& section : _sections) {
+        if (not(section.sh_flags & SHF_ALLOC) or section.sh_type == SHT_NOBITS or section.sh_size == 0
+            or section.sh_addr < text or (extent != 0 and section.sh_addr - text >= extent)) {
+            continue;
+        }
+
+        if (not in_file(section.sh_offset, section.sh_size)) {
+            throw std::runtime_error("vmlinux section out of file: "s + (_names.data() + std::min<size_t>(section.sh_name, _names.size() - 1)));
+        }
+
+        placed.push_back(&section);
+        end = std::max<uintptr_t>(end, section.sh_addr + section.sh_size);
+    }
+
+    if (placed.empty()) {
+        throw std::runtime_error("no vmlinux section after _text");
+    }
+
+    size_t size = end - text;
+
+    // file offset of _text
+    ssize_t base = -1;
+    for (auto* section : placed) {
+        if (text >= section->sh_addr and text - section->sh_addr < section->sh_size) {
+            base = section->sh_offset + (text - section->sh_addr);
+            break;
+        }
+    }
+
+    static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+
+    bool direct = base != -1 and base % page_size == 0 and in_file(base, size)
+        and std::all_of(placed.begin(), placed.end(), [&](const Elf64_Shdr* section) {
+                      return section->sh_offset - base == section->sh_addr - text;
+                  });
+
+    if (direct) {
+        BOOST_LOG_TRIVIAL(debug) << "vmlinux mapped from file offset 0x" << std::hex << base << "+0x" << size << std::dec;
+        return ImageBuffer::map(_fd.get(), size, base);
+    }
+
+    ImageBuffer buffer {};
+    buffer.resize(size);
+
+    for (auto* section : placed) {
+        auto sz = ::pread(_fd.get(), buffer.data() + (section->sh_addr - text), section->sh_size, section->sh_offset);
+        if (sz != static_cast<ssize_t>(section->sh_size)) {
+            throw std::runtime_error("Unable read vmlinux section "s + strerror(errno));
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "vmlinux " << placed.size() << " sections read";
+
+    return buffer;
+}
+
+ssize_t ElfSegments::file_offset(uintptr_t addr) const
+{
+    for (auto& load : loads) {
+        if (addr >= load.p_vaddr and addr - load.p_vaddr < load.p_filesz) {
+            return load.p_offset + (addr - load.p_vaddr);
+        }
+    }
+    return -1;
+}
+
+bool parse_elf_segments(std::string_view head, ElfSegments& segments)
+{
+    Elf64_Ehdr header {};
+    if (head.size() < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, head.data(), sizeof(header));
+    if (not valid_header(header) or header.e_phentsize != sizeof(Elf64_Phdr)
+        or header.e_phoff > head.size() or header.e_phnum * sizeof(Elf64_Phdr) > head.size() - header.e_phoff) {
+        return false;
+    }
+
+    segments.machine = header.e_machine;
+    segments.loads.clear();
+
+    for (size_t i = 0; i < header.e_phnum; ++i) {
+        Elf64_Phdr phdr {};
+        memcpy(&phdr, head.data() + header.e_phoff + i * sizeof(phdr), sizeof(phdr));
+        if (phdr.p_type == PT_LOAD and phdr.p_filesz != 0) {
+            segments.loads.push_back(phdr);
+        }
+    }
+
+    return true;
+}
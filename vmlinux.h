@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2024 pom@vro.life
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef __vmlinux_h__
+#define __vmlinux_h__
+
+#include <elf.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "kdeploy.h"
+#include "utils.h"
+
+// the kernel architecture of an ELF machine
+std::optional<KernelArch> elf_kernel_arch(uint16_t machine);
+
+/*
+    ELF vmlinux file.
+
+    The analysis addresses the image by `addr - _text`. The allocated
+    sections are placed by their section headers: if they keep their
+    distance to _text in the file, as text and rodata do, the image is a
+    private mapping of the file. Otherwise they are read into place.
+*/
+class ElfKernel {
+    UniqueFD _fd {};
+    size_t _file_size { 0 };
+    uint16_t _machine { 0 };
+    std::vector<Elf64_Shdr> _sections {};
+    std::vector<char> _names {}; // section names
+
+    // true if the `size` bytes at `offset` are in the file
+    bool in_file(uint64_t offset, uint64_t size) const;
+
+public:
+    // false if `fd` is not a 64 bit ELF file
+    bool open(UniqueFD fd);
+
+    const Elf64_Shdr* section(std::string_view name) const;
+
+    uint16_t machine() const { return _machine; }
+
+    // address of the first executable section
+    uintptr_t text_address() const;
+
+    bool has_symbols() const { return section(".symtab") != nullptr; }
+
+    // .symtab as symbol map, with a request only the requested symbols are kept
+    bool load_symbols(SymbolIndex& symbols, const SymbolRequest* request = nullptr) const;
+
+    // the allocated sections from `text`, `extent` bytes or all of them for 0
+    ImageBuffer map_image(uintptr_t text, size_t extent = 0) const;
+};
+
+/*
+    Program headers of an ELF image in memory, e.g. the vmlinux
+    decompressed from a bzImage. They follow the ELF header while the
+    section headers are at the end of the file, so the head is enough.
+*/
+struct ElfSegments {
+    uint16_t machine { 0 };
+    std::vector<Elf64_Phdr> loads {};
+
+    // file offset of `addr`, -1 if it is not loaded from the file
+    ssize_t file_offset(uintptr_t addr) const;
+};
+
+bool parse_elf_segments(std::string_view head, ElfSegments& segments);
+
+#endif